@@ -4,6 +4,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <signal.h>
@@ -12,43 +13,191 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <termios.h>
+#include <time.h>
+#ifdef KTLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 
 // Define preprocessor constants for the command buffer, port, and shared secret
 #define BUFF_SIZE 4096
 #define PORT 4070
 #define SECRET "<rembash>\n"
+#define DEFAULT_MAX_CONNECTIONS 32
+#define INIT_HOSTS 64
+#define MAX_EVENTS 64
+#define HOST_TIMEOUT_MS 30000
+
+// Longest line a pty takes before bash sets up line editing; the rest of a longer line, including
+// its newline, is dropped, so a command line sent on connect must fit
+#define MAX_LINE 4095
+
+// Command line options; encrypted transport options are only in builds with kernel TLS
+#ifdef KTLS
+#define OPTIONS "0f:j:TA:"
+#define USAGE "Usage: client [-0] [-T] [-A CA_FILE] SERVER_IP_ADDRESS\n" \
+	"       client [-0] [-T] [-A CA_FILE] -f HOST_FILE [-j MAX_CONNECTIONS] COMMAND\n"
+#else
+#define OPTIONS "0f:j:"
+#define USAGE "Usage: client [-0] SERVER_IP_ADDRESS\n" \
+	"       client [-0] -f HOST_FILE [-j MAX_CONNECTIONS] COMMAND\n"
+#endif
+
+// Values for host state in fan-out mode
+#define HOST_WAITING 0
+#define HOST_CONNECTING 1
+#define HOST_TLS 2
+#define HOST_BANNER 3
+#define HOST_OK 4
+#define HOST_SKIP 5
+#define HOST_MARKER 6
+#define HOST_RUNNING 7
+#define HOST_DONE 8
+
+// Host struct for one connection in fan-out mode
+// line holds protocol messages during the handshake, then the current line of output
+// held_line holds a line that looks like the exit status until it is known to be the last line,
+// and held_blanks the blank lines before it
+// sent counts bytes of the command line already sent in fast open mode
+// deadline is when the host fails if its command has not started running
+typedef struct host {
+	char *address;
+	int sockfd;
+	int state;
+	int status;
+	int blank_lines;
+	int held_blanks;
+	char held_line[32];
+	size_t sent;
+	long deadline;
+	#ifdef KTLS
+	SSL *ssl;
+	#endif
+	size_t line_len;
+	char line[BUFF_SIZE];
+} host_t;
 
 // Function prototypes
-void set_up_socket(int *sockfd, const char * const server_ip);
-void proto_exchange(int sockfd);
+void set_up_socket(int *sockfd, const char * const server_ip, const char *first_data);
+ssize_t fast_connect(int sockfd, struct sockaddr_in *address, const char *data, size_t len);
+void proto_exchange(int sockfd, int secret_sent);
+void read_message(int sockfd, const char *expected, const char *description);
 void set_term_attr();
 int set_sigchld_handler(struct sigaction *act);
 void fork_IO_loops(int sockfd);
 int reset_sigchld_handler(struct sigaction *act);
 void restore_term_attr();
 void sigchld_handler(int signal);
+int fan_out(const char *host_file, const char *command, int max_connections);
+int read_host_file(const char *host_file, host_t **hosts);
+int start_host(int epfd, host_t *host, const char *command_line);
+int handle_host(int epfd, host_t *host, const char *command_line);
+int host_input(host_t *host, const char *data, size_t len, const char *command_line);
+void host_line(host_t *host);
+void print_held_line(host_t *host);
+void finish_host(host_t *host, const char *error);
+long now_ms();
+size_t base64_encode(const char *data, size_t len, char *out);
+#ifdef KTLS
+SSL_CTX *tls_client_ctx(const char *ca_file);
+SSL *tls_new(int sockfd, const char *server_ip);
+int tls_finish(SSL *ssl);
+void tls_connect(int sockfd, const char *server_ip);
+#endif
 
 // Global struct for saved terminal attributes
 struct termios saved_attr;
 
+// Global for fast open mode, where the shared secret and any command are sent with the connection
+// instead of after the server's protocol ID, saving a round trip
+int fast_open = 0;
+
+#ifdef KTLS
+// Global for TLS context, or NULL if connections are not encrypted
+SSL_CTX *tls_ctx = NULL;
+#endif
+
 
 int main(int argc, char **argv)
 {
+	char *host_file = NULL;
+	int max_connections = DEFAULT_MAX_CONNECTIONS;
+	int opt;
+	#ifdef KTLS
+	int use_tls = 0;
+	char *ca_file = NULL;
+	#endif
+
+	// Get fan-out and TLS options from command line
+	while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+		switch (opt) {
+		case '0':
+			fast_open = 1;
+			break;
+		case 'f':
+			host_file = optarg;
+			break;
+		case 'j':
+			if ((max_connections = atoi(optarg)) < 1) {
+				fprintf(stderr, "Client: Invalid number of connections: %s\n", optarg);
+				exit(EXIT_FAILURE); }
+			break;
+		#ifdef KTLS
+		case 'T':
+			use_tls = 1;
+			break;
+		case 'A':
+			use_tls = 1;
+			ca_file = optarg;
+			break;
+		#endif
+		default:
+			fprintf(stderr, USAGE);
+			exit(EXIT_FAILURE); } }
+
 	// Check for proper number of command line arguments
-	if (argc != 2) {
-		fprintf(stderr, "Usage: client SERVER_IP_ADDRESS\n");
+	if (argc - optind != 1) {
+		fprintf(stderr, USAGE);
 		exit(EXIT_FAILURE); }
 
+	#ifdef KTLS
+	// Set up TLS, verifying server against CA_FILE or the system's CAs
+	if (use_tls && (tls_ctx = tls_client_ctx(ca_file)) == NULL) {
+		exit(EXIT_FAILURE); }
+	#endif
+
+	// Run command on every host in host file instead of starting an interactive session
+	if (host_file != NULL) {
+		exit(fan_out(host_file, argv[optind], max_connections)); }
+
 	// Variables for socket connection
-	const char * const server_ip = argv[1];
+	const char * const server_ip = argv[optind];
 	int sockfd;
 
+	// In fast open mode, send shared secret with the connection request
+	// With TLS, it can only be sent once the TLS handshake is done
+	const char *first_data = fast_open ? SECRET : NULL;
+	#ifdef KTLS
+	if (tls_ctx != NULL) {
+		first_data = NULL; }
+	#endif
+
 	// Set up client socket and connect to server
-	set_up_socket(&sockfd, server_ip);
+	set_up_socket(&sockfd, server_ip, first_data);
+
+	#ifdef KTLS
+	// Run TLS handshake and hand encryption to the kernel, then send shared secret in fast open mode
+	if (tls_ctx != NULL) {
+		tls_connect(sockfd, server_ip);
+		if (fast_open && write(sockfd, SECRET, strlen(SECRET)) == -1) {
+			perror("Client: Error writing shared secret to socket");
+			exit(EXIT_FAILURE); } }
+	#endif
 
 	// Handle protocol exchange with server
-	proto_exchange(sockfd);
+	proto_exchange(sockfd, fast_open);
 
 	// Set noncanonical mode and disable echoing
 	set_term_attr();
@@ -66,7 +215,8 @@ int main(int argc, char **argv)
 
 
 // Function to create socket and connect to server
-void set_up_socket(int *sockfd, const char * const server_ip)
+// If first_data is not NULL, it is sent with the connection request using TCP Fast Open
+void set_up_socket(int *sockfd, const char * const server_ip, const char *first_data)
 {
 	// Struct for server
 	struct sockaddr_in address;
@@ -82,54 +232,86 @@ void set_up_socket(int *sockfd, const char * const server_ip)
 	address.sin_port = htons(PORT);
 	inet_aton(server_ip, &address.sin_addr);
 
-	// Connect client socket to server socket
-	if (connect(*sockfd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+	// Connect client socket to server socket, sending first_data with the connection request
+	// and any of it the kernel held back once connected
+	if (first_data != NULL) {
+		ssize_t nsent;
+		if ((nsent = fast_connect(*sockfd, &address, first_data, strlen(first_data))) == -1) {
+			perror("Client: failed to connect socket to server");
+			exit(EXIT_FAILURE); }
+		if (write(*sockfd, first_data + nsent, strlen(first_data) - nsent) == -1) {
+			perror("Client: Error writing to socket");
+			exit(EXIT_FAILURE); } }
+	else if (connect(*sockfd, (struct sockaddr *)&address, sizeof(address)) == -1) {
 		perror("Client: failed to connect socket to server");
 		exit(EXIT_FAILURE); }
 
 	return;
 }
 
+// Function to connect socket to address, sending data in the SYN if the server gave a fast open cookie
+// Falls back to a regular connect if the kernel has TCP Fast Open turned off for clients
+// Returns number of bytes of data sent, 0 if none were sent yet, or -1 on failure
+ssize_t fast_connect(int sockfd, struct sockaddr_in *address, const char *data, size_t len)
+{
+	ssize_t nsent;
+
+	// A non-blocking socket without a cookie yet only sends the SYN, and its data is sent after connecting
+	if ((nsent = sendto(sockfd, data, len, MSG_FASTOPEN, (struct sockaddr *)address, sizeof(*address))) != -1) {
+		return nsent; }
+	if (errno == EINPROGRESS) {
+		return 0; }
+	if (errno != EOPNOTSUPP) {
+		return -1; }
+
+	if (connect(sockfd, (struct sockaddr *)address, sizeof(*address)) == -1 && errno != EINPROGRESS) {
+		return -1; }
+
+	return 0;
+}
+
 // Function for rembash protocol exchange with server
-void proto_exchange(int sockfd)
+// If secret_sent is set, the shared secret was already sent without waiting for the protocol ID
+void proto_exchange(int sockfd, int secret_sent)
 {
 	// Variables for protocol exchange
 	const char * const rembash = "<rembash>\n";
 	const char * const ok = "<ok>\n";
-	char input[513];
-	ssize_t nread;
-
-	// Get initial message from server
-	if ((nread = read(sockfd, input, 512)) < 1) {
-		if (errno) {
-			perror("Client: Error reading protocol ID from server"); }
-		else {
-			fprintf(stderr,"Client: server connection closed unexpectedly\n"); }
-		exit(EXIT_FAILURE); }
 
 	// Check that first message from server is "<rembash>\n"
-	input[nread] = '\0';
-	if (strcmp(input, rembash)) {
-		fprintf(stderr, "Client: invalid protocol ID from server: %s\n", input);
-		exit(EXIT_FAILURE); }
+	read_message(sockfd, rembash, "protocol ID");
 
 	// Write shared secret to server
-	if (write(sockfd, SECRET, strlen(SECRET)) == -1) {
+	if (!secret_sent && write(sockfd, SECRET, strlen(SECRET)) == -1) {
 		perror("Client: Error writing shared secret to socket");
 		exit(EXIT_FAILURE); }
 
-	// Get last protocol message from server
-	if ((nread = read(sockfd, input, 512)) < 1) {
-		if (errno) {
-			perror("Client: Error reading shared secret acknowledgment from server"); }
-		else {
-			fprintf(stderr, "Client: server connection closed unexpectedly\n"); }
-		exit(EXIT_FAILURE); }
+	// Check that last protocol message is "<ok>\n"
+	read_message(sockfd, ok, "shared secret acknowledgment");
+
+	return;
+}
+
+// Function to read one protocol message from server and check that it is the expected one
+// Reads only the message's length, since the server's next message or bash output may follow it
+void read_message(int sockfd, const char *expected, const char *description)
+{
+	char input[513];
+	size_t len = strlen(expected), total = 0;
+	ssize_t nread;
 
-	// Check that last protocol message is "<ok>\n
-	input[nread] = '\0';
-	if (strcmp(input, ok)) {
-		fprintf(stderr, "Client: invalid shared secret acknowledgment from server\n");
+	while (total < len) {
+		if ((nread = read(sockfd, input + total, len - total)) < 1) {
+			if (nread == -1) {
+				fprintf(stderr, "Client: Error reading %s from server: %s\n", description, strerror(errno)); }
+			else {
+				fprintf(stderr, "Client: server connection closed unexpectedly\n"); }
+			exit(EXIT_FAILURE); }
+		total += nread; }
+
+	input[total] = '\0';
+	if (strcmp(input, expected)) {
+		fprintf(stderr, "Client: invalid %s from server: %s\n", description, input);
 		exit(EXIT_FAILURE); }
 
 	return;
@@ -279,5 +461,534 @@ void sigchld_handler(int signal)
 	exit(EXIT_FAILURE);
 }
 
+// Function to run command on every host listed in host_file, with at most max_connections at once
+// Output lines are prefixed with the host's address, and each host's exit status is reported
+// Returns EXIT_SUCCESS if command exited with status 0 on every host, or EXIT_FAILURE otherwise
+int fan_out(const char *host_file, const char *command, int max_connections)
+{
+	host_t *hosts;
+	int num_hosts, next_host = 0, first_pending = 0, active = 0, failed = 0;
+	int epfd, ready_fds, timeout;
+	struct epoll_event events[MAX_EVENTS];
+	char *command_line;
+
+	// Get list of hosts
+	if ((num_hosts = read_host_file(host_file, &hosts)) < 1) {
+		if (num_hosts == 0) {
+			fprintf(stderr, "Client: No hosts in %s\n", host_file); }
+		return EXIT_FAILURE; }
+
+	// Build line for remote bash; it prints a marker byte so the echoed line and prompt can be skipped,
+	// then replaces itself with bash running the command, so the command's exit status is bash's
+	// The command is base64 encoded, so neither bash's line editing nor the pty can change any of it
+	// In fast open mode, the line starts with the shared secret, and all of it is sent on connect
+	const char * const line_start = "printf '\\036\\n'; exec bash -c \"$(echo ";
+	const char * const line_end = " | base64 -d)\"\n";
+	size_t line_len = strlen(line_start) + (strlen(command)+2) / 3 * 4 + strlen(line_end);
+	if (line_len > MAX_LINE) {
+		fprintf(stderr, "Client: Command is too long; at most %zu bytes can be sent\n",
+				(MAX_LINE - strlen(line_start) - strlen(line_end)) / 4 * 3);
+		return EXIT_FAILURE; }
+	if ((command_line = malloc(strlen(SECRET) + line_len + 1)) == NULL) {
+		perror("Client: Error allocating memory for command");
+		return EXIT_FAILURE; }
+	char *c = command_line + sprintf(command_line, "%s%s", fast_open ? SECRET : "", line_start);
+	c += base64_encode(command, strlen(command), c);
+	strcpy(c, line_end);
+
+	// Ignore SIGPIPE so a host closing its connection does not kill the client
+	// Line buffer stdout so lines from different hosts are not mixed together
+	signal(SIGPIPE, SIG_IGN);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	// Create epoll unit
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("Client: Error creating epoll unit");
+		return EXIT_FAILURE; }
+
+	// Loop until every host is finished, keeping up to max_connections hosts active
+	while (next_host < num_hosts || active > 0) {
+		// Start connecting to more hosts if there is room
+		while (active < max_connections && next_host < num_hosts) {
+			if (start_host(epfd, &hosts[next_host++], command_line) == 0) {
+				active++; }
+			else {
+				failed++; } }
+
+		// Wait until the first host whose command has not started yet times out
+		// Hosts are started in order, so it has the earliest deadline
+		while (first_pending < next_host && hosts[first_pending].state >= HOST_RUNNING) {
+			first_pending++; }
+		timeout = -1;
+		if (first_pending < next_host) {
+			long left = hosts[first_pending].deadline - now_ms();
+			timeout = (left > 0) ? left : 0; }
+
+		if ((ready_fds = epoll_wait(epfd, events, MAX_EVENTS, timeout)) == -1) {
+			if (errno == EINTR) {
+				continue; }
+			perror("Client: epoll_wait failed");
+			return EXIT_FAILURE; }
+
+		// Loop through ready hosts and handle their I/O
+		for (int i=0; i < ready_fds; i++) {
+			host_t *host = events[i].data.ptr;
+			if (handle_host(epfd, host, command_line)) {
+				active--;
+				if (host->status != 0) {
+					failed++; } } }
+
+		// Finish hosts that did not connect, finish the handshake, or start the command in time
+		long now = now_ms();
+		for (int i=first_pending; i < next_host && hosts[i].deadline <= now; i++) {
+			if (hosts[i].state < HOST_RUNNING) {
+				finish_host(&hosts[i], "timed out");
+				active--;
+				failed++; } }
+	}
+
+	free(command_line);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Function to read IPv4 addresses from host_file, one per line, or from stdin if host_file is "-"
+// Blank lines and lines starting with '#' are skipped
+// Returns number of hosts read, or -1 on failure
+int read_host_file(const char *host_file, host_t **hosts)
+{
+	FILE *file;
+	char buff[256];
+	int num_hosts = 0, max_hosts = INIT_HOSTS;
+
+	if (strcmp(host_file, "-") == 0) {
+		file = stdin; }
+	else if ((file = fopen(host_file, "r")) == NULL) {
+		perror("Client: Error opening host file");
+		return -1; }
+
+	if ((*hosts = malloc(max_hosts * sizeof(host_t))) == NULL) {
+		perror("Client: Error allocating memory for hosts");
+		return -1; }
+
+	while (fgets(buff, sizeof(buff), file) != NULL) {
+		char *address = strtok(buff, " \t\r\n");
+		if (address == NULL || address[0] == '#') {
+			continue; }
+
+		// If host array is full, expand it
+		if (num_hosts == max_hosts) {
+			max_hosts *= 2;
+			if ((*hosts = realloc(*hosts, max_hosts * sizeof(host_t))) == NULL) {
+				perror("Client: Error allocating memory for hosts");
+				return -1; } }
+
+		// Add host that has not been started yet
+		host_t *host = &(*hosts)[num_hosts++];
+		host->state = HOST_WAITING;
+		host->status = -1;
+		host->blank_lines = 0;
+		host->held_blanks = 0;
+		host->held_line[0] = '\0';
+		host->line_len = 0;
+		#ifdef KTLS
+		host->ssl = NULL;
+		#endif
+		if ((host->address = strdup(address)) == NULL) {
+			perror("Client: Error allocating memory for host address");
+			return -1; }
+	}
+
+	if (file != stdin) {
+		fclose(file); }
+
+	return num_hosts;
+}
+
+// Function to start non-blocking connection to host and add it to the epoll interest list
+// In fast open mode, as much of command_line as fits is sent with the connection request
+// Returns 0 on success or -1 on failure
+int start_host(int epfd, host_t *host, const char *command_line)
+{
+	struct sockaddr_in address;
+	struct epoll_event event;
+	ssize_t nsent = 0;
+	int send_first = fast_open;
+	#ifdef KTLS
+	if (tls_ctx != NULL) {
+		send_first = 0; }
+	#endif
+
+	// Host fails if its command is not running by its deadline
+	host->deadline = now_ms() + HOST_TIMEOUT_MS;
+
+	// Set up socket struct
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(PORT);
+	if (inet_aton(host->address, &address.sin_addr) == 0) {
+		finish_host(host, "invalid IPv4 address");
+		return -1; }
+
+	// Create non-blocking socket and start connecting to server
+	if ((host->sockfd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1) {
+		finish_host(host, strerror(errno));
+		return -1; }
+	host->state = HOST_CONNECTING;
+	if (send_first) {
+		nsent = fast_connect(host->sockfd, &address, command_line, strlen(command_line)); }
+	else if (connect(host->sockfd, (struct sockaddr *)&address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+		nsent = -1; }
+	if (nsent == -1) {
+		finish_host(host, strerror(errno));
+		return -1; }
+	host->sent = nsent;
+
+	// Socket becomes writable when connection is finished
+	event.events = EPOLLIN|EPOLLOUT;
+	event.data.ptr = host;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, host->sockfd, &event) == -1) {
+		finish_host(host, strerror(errno));
+		return -1; }
+
+	return 0;
+}
+
+// Function to handle I/O for a ready host
+// Returns 1 if host is finished, or 0 if it is still active
+int handle_host(int epfd, host_t *host, const char *command_line)
+{
+	char buff[BUFF_SIZE];
+	ssize_t nread;
+	int err;
+	socklen_t len = sizeof(err);
+
+	// Check whether connection succeeded, then only wait for input from server
+	if (host->state == HOST_CONNECTING) {
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = host;
+		if (getsockopt(host->sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+			finish_host(host, strerror(err ? err : errno));
+			return 1; }
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, host->sockfd, &event) == -1) {
+			finish_host(host, strerror(errno));
+			return 1; }
+		host->state = HOST_BANNER;
+		#ifdef KTLS
+		if (tls_ctx != NULL) {
+			host->state = HOST_TLS; }
+		#endif
+	}
+
+	#ifdef KTLS
+	// Continue TLS handshake; once the kernel has the keys, the rembash protocol runs as usual
+	if (host->state == HOST_TLS) {
+		if (host->ssl == NULL && (host->ssl = tls_new(host->sockfd, host->address)) == NULL) {
+			finish_host(host, "error creating TLS connection");
+			return 1; }
+
+		// Handshake only sends small messages, so it waits on the server for either want
+		int ret = SSL_connect(host->ssl);
+		if (ret != 1) {
+			int ssl_err = SSL_get_error(host->ssl, ret);
+			if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
+				return 0; }
+			finish_host(host, "TLS handshake failed");
+			return 1; }
+
+		ret = tls_finish(host->ssl);
+		host->ssl = NULL;
+		if (ret == -1) {
+			finish_host(host, "kernel TLS is not available");
+			return 1; }
+		host->state = HOST_BANNER; }
+	#endif
+
+	// In fast open mode, send the rest of the command line as soon as the connection is ready
+	if (fast_open && host->state == HOST_BANNER && host->sent < strlen(command_line)) {
+		size_t len = strlen(command_line) - host->sent;
+		if (write(host->sockfd, command_line + host->sent, len) != (ssize_t)len) {
+			finish_host(host, "error writing to socket");
+			return 1; }
+		host->sent += len; }
+
+	// Read everything available from server
+	while ((nread = read(host->sockfd, buff, BUFF_SIZE)) > 0) {
+		if (host_input(host, buff, nread, command_line) == -1) {
+			return 1; } }
+
+	// Server closed connection; finish last line of output
+	if (nread == 0) {
+		if (host->state != HOST_RUNNING) {
+			finish_host(host, "connection closed before command ran");
+			return 1; }
+		if (host->line_len > 0) {
+			host_line(host); }
+		finish_host(host, NULL);
+		return 1; }
+
+	if (errno != EAGAIN) {
+		finish_host(host, strerror(errno));
+		return 1; }
+
+	return 0;
+}
+
+// Function to run rembash protocol and split command output into lines for a host
+// Returns 0 on success, or -1 if host failed and was finished
+int host_input(host_t *host, const char *data, size_t len, const char *command_line)
+{
+	const char * const rembash = "<rembash>\n";
+	const char * const ok = "<ok>\n";
+
+	for (size_t i=0; i < len; i++) {
+		char c = data[i];
+
+		switch (host->state) {
+		case HOST_BANNER: // Waiting for protocol ID, then sending shared secret
+		case HOST_OK: // Waiting for shared secret acknowledgment, then sending command
+			if (host->line_len == BUFF_SIZE - 1) {
+				finish_host(host, "invalid protocol message from server");
+				return -1; }
+			host->line[host->line_len++] = c;
+			host->line[host->line_len] = '\0';
+			const char *expected = (host->state == HOST_BANNER) ? rembash : ok;
+			if (host->line_len < strlen(expected) ||
+					strcmp(host->line + host->line_len - strlen(expected), expected)) {
+				break; }
+
+			// In fast open mode, the secret and command were already sent, so messages are only checked
+			const char *reply = (host->state == HOST_BANNER) ? SECRET : command_line;
+			if (!fast_open && write(host->sockfd, reply, strlen(reply)) != (ssize_t)strlen(reply)) {
+				finish_host(host, "error writing to socket");
+				return -1; }
+			host->line_len = 0;
+			host->state = (host->state == HOST_BANNER) ? HOST_OK : HOST_SKIP;
+			break;
+
+		case HOST_SKIP: // Skipping prompt and echoed command until marker
+			if (c == '\036') {
+				host->state = HOST_MARKER; }
+			break;
+
+		case HOST_MARKER: // Skipping rest of marker line
+			if (c == '\n') {
+				host->state = HOST_RUNNING; }
+			break;
+
+		case HOST_RUNNING: // Collecting output lines
+			if (c == '\n') {
+				host_line(host);
+				break; }
+			host->line[host->line_len++] = c;
+			if (host->line_len == BUFF_SIZE - 1) {
+				host_line(host); }
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// Function to print a host's current output line prefixed with its address
+// The server ends a session with a blank line and its exit status, which are taken out of the output
+// A line that looks like the exit status is held, since it is only the status if no output follows it
+void host_line(host_t *host)
+{
+	// Remove carriage return added by the pty
+	if (host->line_len > 0 && host->line[host->line_len-1] == '\r') {
+		host->line_len--; }
+	host->line[host->line_len] = '\0';
+
+	// Hold blank lines until it is known whether they come before the exit status
+	if (host->line_len == 0) {
+		host->blank_lines++;
+		return; }
+
+	// Output followed the held line, so it was not the exit status
+	print_held_line(host);
+
+	// Hold line if it looks like the exit status, along with the blank lines before it
+	int end = 0;
+	if (host->line_len < sizeof(host->held_line) && sscanf(host->line, "<exit %*d>%n", &end) == 0 &&
+			end == (int)host->line_len) {
+		strcpy(host->held_line, host->line);
+		host->held_blanks = host->blank_lines;
+		host->blank_lines = 0;
+		host->line_len = 0;
+		return; }
+
+	// Print held blank lines, then current line
+	while (host->blank_lines > 0) {
+		printf("%s: \n", host->address);
+		host->blank_lines--; }
+	printf("%s: %s\n", host->address, host->line);
+
+	host->line_len = 0;
+}
+
+// Function to print a host's held line as output, along with the blank lines before it
+void print_held_line(host_t *host)
+{
+	if (host->held_line[0] == '\0') {
+		return; }
+
+	while (host->held_blanks > 0) {
+		printf("%s: \n", host->address);
+		host->held_blanks--; }
+	printf("%s: %s\n", host->address, host->held_line);
+
+	host->held_line[0] = '\0';
+}
+
+// Function to close a host's connection and report its result
+// If error is NULL, the host's exit status is reported
+void finish_host(host_t *host, const char *error)
+{
+	if (host->state != HOST_WAITING) {
+		close(host->sockfd); }
+
+	// Held line is the exit status if it was the last line before the server closed the connection
+	// and drop the blank line the server sends before it
+	if (error == NULL && host->held_line[0] != '\0' && host->blank_lines == 0) {
+		sscanf(host->held_line, "<exit %d>", &host->status);
+		host->held_line[0] = '\0';
+		if (host->held_blanks > 0) {
+			host->held_blanks--; }
+		while (host->held_blanks > 0) {
+			printf("%s: \n", host->address);
+			host->held_blanks--; } }
+	else {
+		print_held_line(host); }
+
+	#ifdef KTLS
+	SSL_free(host->ssl);
+	host->ssl = NULL;
+	#endif
+
+	if (error != NULL) {
+		host->status = -1;
+		fprintf(stderr, "%s: failed: %s\n", host->address, error); }
+	else if (host->status == -1) {
+		fprintf(stderr, "%s: connection closed without exit status\n", host->address); }
+	else {
+		fprintf(stderr, "%s: exited with status %d\n", host->address, host->status); }
+
+	host->state = HOST_DONE;
+}
+
+// Function to get monotonic clock time in milliseconds
+long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Function to base64 encode len bytes of data into out, which must have room for (len+2)/3*4 bytes
+// Returns number of bytes written
+size_t base64_encode(const char *data, size_t len, char *out)
+{
+	const char * const digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const unsigned char *in = (const unsigned char *)data;
+	size_t n = 0;
+
+	// Encode each group of three bytes as four digits, padding the last group with '='
+	for (size_t i=0; i < len; i += 3) {
+		unsigned long group = (unsigned long)in[i] << 16;
+		if (i+1 < len) {
+			group |= in[i+1] << 8; }
+		if (i+2 < len) {
+			group |= in[i+2]; }
+		out[n++] = digits[group >> 18 & 0x3F];
+		out[n++] = digits[group >> 12 & 0x3F];
+		out[n++] = (i+1 < len) ? digits[group >> 6 & 0x3F] : '=';
+		out[n++] = (i+2 < len) ? digits[group & 0x3F] : '='; }
+
+	return n;
+}
+
+#ifdef KTLS
+// Function to create TLS context that verifies servers against ca_file, or the system's CAs if NULL
+// Sessions are limited to TLS 1.2 with AES-GCM or ChaCha20-Poly1305, which OpenSSL can hand to
+// the kernel in both directions
+// Returns new context, or NULL on failure
+SSL_CTX *tls_client_ctx(const char *ca_file)
+{
+	SSL_CTX *ctx;
+
+	if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL ||
+			!SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) ||
+			!SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION) ||
+			!SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20")) {
+		fprintf(stderr, "Client: Error creating TLS context\n");
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return NULL; }
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS|SSL_OP_NO_RENEGOTIATION);
+
+	// Load CAs for verifying server certificates
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if ((ca_file != NULL && SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) ||
+			(ca_file == NULL && SSL_CTX_set_default_verify_paths(ctx) != 1)) {
+		fprintf(stderr, "Client: Error loading TLS CA certificates\n");
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return NULL; }
+
+	return ctx;
+}
+
+// Function to create TLS connection for socket that checks the server certificate matches server_ip
+// Returns new connection, or NULL on failure
+SSL *tls_new(int sockfd, const char *server_ip)
+{
+	SSL *ssl;
+
+	if ((ssl = SSL_new(tls_ctx)) == NULL || SSL_set_fd(ssl, sockfd) != 1 ||
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), server_ip) != 1) {
+		ERR_print_errors_fp(stderr);
+		SSL_free(ssl);
+		return NULL; }
+
+	return ssl;
+}
+
+// Function to free TLS connection once its handshake is done
+// Reads and writes on the socket are then encrypted by the kernel, so the I/O loops are unchanged
+// Returns 0 on success, or -1 if the kernel did not take over encryption in both directions
+int tls_finish(SSL *ssl)
+{
+	int ktls = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+
+	// Freeing connection leaves the socket open
+	SSL_free(ssl);
+
+	return ktls ? 0 : -1;
+}
+
+// Function to run TLS handshake with server on blocking socket and hand encryption to the kernel
+void tls_connect(int sockfd, const char *server_ip)
+{
+	SSL *ssl;
+
+	if ((ssl = tls_new(sockfd, server_ip)) == NULL) {
+		fprintf(stderr, "Client: Error creating TLS connection\n");
+		exit(EXIT_FAILURE); }
+
+	if (SSL_connect(ssl) != 1) {
+		fprintf(stderr, "Client: TLS handshake with server failed\n");
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE); }
+
+	if (tls_finish(ssl) == -1) {
+		fprintf(stderr, "Client: Kernel TLS is not available; is the tls module loaded?\n");
+		exit(EXIT_FAILURE); }
+
+	return;
+}
+#endif
+
 
 // EOF
@@ -0,0 +1,419 @@
+// RemoteBASH
+// Session Recorder Source
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include "record.h"
+
+// Queue size must be a power of two so slot positions stay valid when they wrap around
+#define RECORD_QUEUE_SLOTS 4096
+#define RECORD_MAX_BYTES (16*1024*1024)
+#define RECORD_FILE_BUFF (64*1024)
+#define RECORD_IDLE_NSEC 50000000
+#define RECORD_OPEN 1
+#define RECORD_CLOSE 2
+#define TERM_WIDTH 80
+#define TERM_HEIGHT 24
+
+// Chunk struct for one queued recorder event and its data
+typedef struct record_chunk {
+    int session;
+    char type;
+    struct timespec time;
+    size_t len;
+    char data[];
+} record_chunk_t;
+
+// Slot struct for the lock-free queue; seq tells producers and the writer whose turn the slot is
+typedef struct record_slot {
+    size_t seq;
+    record_chunk_t *chunk;
+} record_slot_t;
+
+// File struct for an open session recording
+// Unfinished UTF-8 characters at the end of a chunk are carried to the next event of the same type
+typedef struct record_file {
+    FILE *file;
+    struct timespec start;
+    int dirty;
+    int failed;
+    char carry[2][4];
+    size_t carry_len[2];
+} record_file_t;
+
+// Recorder struct with variables for queue, memory budget, and session files
+typedef struct record {
+    record_slot_t slots[RECORD_QUEUE_SLOTS];
+    size_t enqueue_pos;
+    size_t dequeue_pos;
+    size_t flushed_pos;
+    size_t queued_bytes;
+    unsigned long dropped;
+    unsigned long reported_dropped;
+    unsigned long file_count;
+    record_file_t *files;
+    int max_sessions;
+    const char *dir;
+} record_t;
+
+// Declare record struct for the recorder
+static record_t rec;
+
+// Function to add chunk to queue without locking; any number of relay threads may call it at once
+// Returns 1 on success or 0 if queue is full
+static int queue_push(record_chunk_t *chunk)
+{
+    size_t pos = __atomic_load_n(&rec.enqueue_pos, __ATOMIC_RELAXED);
+    record_slot_t *slot;
+
+    while (1) {
+        slot = &rec.slots[pos % RECORD_QUEUE_SLOTS];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - pos);
+
+        // Slot is free, so try to claim it; on failure pos is updated to the current position
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&rec.enqueue_pos, &pos, pos+1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break; } }
+
+        // Slot still holds a chunk the writer has not taken, so queue is full
+        else if (diff < 0) {
+            return 0; }
+
+        // Another producer claimed slot first, so try again at the current position
+        else {
+            pos = __atomic_load_n(&rec.enqueue_pos, __ATOMIC_RELAXED); }
+    }
+
+    // Store chunk, then publish slot to the writer
+    slot->chunk = chunk;
+    __atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+// Function to take next chunk from queue; only called by the writer thread
+// Returns NULL if queue is empty
+static record_chunk_t *queue_pop(void)
+{
+    record_slot_t *slot = &rec.slots[rec.dequeue_pos % RECORD_QUEUE_SLOTS];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != rec.dequeue_pos+1) {
+        return NULL; }
+
+    // Take chunk, then hand slot back to producers for the next lap around the queue
+    record_chunk_t *chunk = slot->chunk;
+    __atomic_store_n(&slot->seq, rec.dequeue_pos + RECORD_QUEUE_SLOTS, __ATOMIC_RELEASE);
+    rec.dequeue_pos++;
+
+    return chunk;
+}
+
+// Function to copy event into a chunk and queue it for the writer thread
+// Drops the event and counts it if the memory budget is spent or queue is full
+static void record_push(int session, char type, const char *data, size_t len)
+{
+    size_t size = sizeof(record_chunk_t) + len;
+    record_chunk_t *chunk;
+
+    // Check that recording is enabled and session is in range
+    if (rec.files == NULL || session < 0 || session >= rec.max_sessions) {
+        return; }
+
+    // Reserve space in memory budget, then allocate chunk
+    if (__atomic_add_fetch(&rec.queued_bytes, size, __ATOMIC_RELAXED) > RECORD_MAX_BYTES ||
+            (chunk = malloc(size)) == NULL) {
+        __atomic_sub_fetch(&rec.queued_bytes, size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&rec.dropped, 1, __ATOMIC_RELAXED);
+        return; }
+
+    // Fill in chunk
+    chunk->session = session;
+    chunk->type = type;
+    chunk->len = len;
+    clock_gettime(CLOCK_MONOTONIC, &chunk->time);
+    if (len > 0) {
+        memcpy(chunk->data, data, len); }
+
+    // Queue chunk
+    if (!queue_push(chunk)) {
+        free(chunk);
+        __atomic_sub_fetch(&rec.queued_bytes, size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&rec.dropped, 1, __ATOMIC_RELAXED); }
+}
+
+// Function to get number of bytes at end of data that start an unfinished UTF-8 character
+static size_t utf8_partial(const char *data, size_t len)
+{
+    for (size_t i=1; i <= 3 && i <= len; i++) {
+        unsigned char c = data[len-i];
+
+        // Skip continuation bytes until the character's first byte is found
+        if ((c & 0xC0) == 0x80) {
+            continue; }
+
+        size_t need = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+        return (need > i) ? i : 0;
+    }
+
+    return 0;
+}
+
+// Function to get length of the valid UTF-8 character at the start of data, or 0 if it is not one
+// Overlong forms, surrogates, and code points past U+10FFFF are not valid
+static size_t utf8_char_len(const unsigned char *data, size_t len)
+{
+    unsigned char c = data[0];
+    size_t need;
+    unsigned char lo = 0x80, hi = 0xBF;
+
+    if (c < 0x80) {
+        return 1; }
+    else if (c >= 0xC2 && c <= 0xDF) {
+        need = 2; }
+    else if (c >= 0xE0 && c <= 0xEF) {
+        need = 3;
+        lo = (c == 0xE0) ? 0xA0 : 0x80;
+        hi = (c == 0xED) ? 0x9F : 0xBF; }
+    else if (c >= 0xF0 && c <= 0xF4) {
+        need = 4;
+        lo = (c == 0xF0) ? 0x90 : 0x80;
+        hi = (c == 0xF4) ? 0x8F : 0xBF; }
+    else {
+        return 0; }
+
+    // Check second byte against its narrower range, then the rest as continuation bytes
+    if (len < need || data[1] < lo || data[1] > hi) {
+        return 0; }
+    for (size_t i=2; i < need; i++) {
+        if ((data[i] & 0xC0) != 0x80) {
+            return 0; } }
+
+    return need;
+}
+
+// Function to write data to file as the contents of a JSON string
+// Bytes that are not part of a valid UTF-8 character are written as U+FFFD, so the file stays valid UTF-8
+static void write_json(FILE *file, const char *data, size_t len)
+{
+    for (size_t i=0; i < len; i++) {
+        unsigned char c = data[i];
+
+        if (c >= 0x80) {
+            size_t n = utf8_char_len((const unsigned char *)data + i, len - i);
+            if (n == 0) {
+                fputs("\\ufffd", file); }
+            else {
+                fwrite(data + i, 1, n, file);
+                i += n - 1; } }
+        else if (c == '"' || c == '\\') {
+            putc('\\', file);
+            putc(c, file); }
+        else if (c == '\n') {
+            fputs("\\n", file); }
+        else if (c == '\r') {
+            fputs("\\r", file); }
+        else if (c < 0x20 || c == 0x7F) {
+            fprintf(file, "\\u%04x", c); }
+        else {
+            putc(c, file); }
+    }
+}
+
+// Function to create a new append-only recording file and write its asciinema header
+// Returns 1 on success or 0 on failure
+static int open_file(record_file_t *rf, struct timespec *start)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/rembash-%ld-%lu.cast", rec.dir, (long)time(NULL), ++rec.file_count);
+
+    // Open file and give it a large buffer so events are written in batches
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600)) == -1 ||
+            (rf->file = fdopen(fd, "a")) == NULL) {
+        perror("Recorder: Error opening recording file");
+        if (fd != -1) {
+            close(fd); }
+        rf->failed = 1;
+        return 0; }
+    setvbuf(rf->file, NULL, _IOFBF, RECORD_FILE_BUFF);
+
+    rf->start = *start;
+    rf->carry_len[0] = 0;
+    rf->carry_len[1] = 0;
+    rf->dirty = 1;
+    fprintf(rf->file, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %ld}\n",
+            TERM_WIDTH, TERM_HEIGHT, (long)time(NULL));
+
+    return 1;
+}
+
+// Function to close a session's recording file, if it has one
+static void close_file(record_file_t *rf)
+{
+    if (rf->file != NULL) {
+        fclose(rf->file);
+        rf->file = NULL; }
+    rf->failed = 0;
+}
+
+// Function to write one chunk to its session's recording file
+static void write_chunk(record_chunk_t *chunk)
+{
+    record_file_t *rf = &rec.files[chunk->session];
+
+    if (chunk->type == RECORD_CLOSE) {
+        close_file(rf);
+        return; }
+
+    if (chunk->type == RECORD_OPEN) {
+        close_file(rf);
+        open_file(rf, &chunk->time);
+        return; }
+
+    // Open file here if session's open event was dropped
+    if (rf->failed || (rf->file == NULL && !open_file(rf, &chunk->time))) {
+        return; }
+
+    // Join any carried bytes with this chunk's data
+    int t = (chunk->type == RECORD_OUTPUT) ? 0 : 1;
+    char *data = chunk->data;
+    size_t len = chunk->len;
+    if (rf->carry_len[t] > 0 && (data = malloc(rf->carry_len[t] + len)) != NULL) {
+        memcpy(data, rf->carry[t], rf->carry_len[t]);
+        memcpy(data + rf->carry_len[t], chunk->data, len);
+        len += rf->carry_len[t]; }
+    else {
+        data = chunk->data; }
+
+    // Hold back an unfinished UTF-8 character so it is written whole with the next event,
+    // instead of as replacement characters
+    size_t partial = utf8_partial(data, len);
+    len -= partial;
+    memcpy(rf->carry[t], data + len, partial);
+    rf->carry_len[t] = partial;
+
+    // Write event as [seconds since start, type, data]
+    double elapsed = (chunk->time.tv_sec - rf->start.tv_sec) + (chunk->time.tv_nsec - rf->start.tv_nsec) / 1e9;
+    fprintf(rf->file, "[%.6f, \"%c\", \"", elapsed, chunk->type);
+    write_json(rf->file, data, len);
+    fputs("\"]\n", rf->file);
+    rf->dirty = 1;
+
+    if (data != chunk->data) {
+        free(data); }
+}
+
+// Function to flush batched writes of all sessions and report any newly dropped chunks
+static void flush_files(void)
+{
+    for (int i=0; i < rec.max_sessions; i++) {
+        if (rec.files[i].dirty && rec.files[i].file != NULL) {
+            fflush(rec.files[i].file);
+            rec.files[i].dirty = 0; }
+    }
+
+    unsigned long dropped = __atomic_load_n(&rec.dropped, __ATOMIC_RELAXED);
+    if (dropped != rec.reported_dropped) {
+        fprintf(stderr, "Recorder: %lu chunks dropped so far; disk is falling behind\n", dropped);
+        rec.reported_dropped = dropped; }
+}
+
+// Writer function for the recorder thread
+static void *record_writer(void *arg)
+{
+    struct timespec idle = {0, RECORD_IDLE_NSEC};
+    record_chunk_t *chunk;
+
+    while (1) {
+        // Write every queued chunk into its file's buffer
+        while ((chunk = queue_pop()) != NULL) {
+            write_chunk(chunk);
+            __atomic_sub_fetch(&rec.queued_bytes, sizeof(record_chunk_t) + chunk->len, __ATOMIC_RELAXED);
+            free(chunk); }
+
+        // Queue is empty, so write out batched data and wait for more
+        flush_files();
+        __atomic_store_n(&rec.flushed_pos, rec.dequeue_pos, __ATOMIC_RELEASE);
+        nanosleep(&idle, NULL);
+    }
+
+    // Should not get here
+    return NULL;
+}
+
+// Function to initialize record struct and create writer thread
+// Recordings are written to dir for sessions numbered 0 to max_sessions-1
+int record_init(const char *dir, int max_sessions)
+{
+    pthread_t writer_tid;
+    pthread_attr_t attr;
+
+    // Initialize queue slots so each one is free for its first lap around the queue
+    for (size_t i=0; i < RECORD_QUEUE_SLOTS; i++) {
+        rec.slots[i].seq = i; }
+
+    rec.dir = dir;
+    rec.max_sessions = max_sessions;
+
+    // Allocate session file array
+    if ((rec.files = calloc(max_sessions, sizeof(record_file_t))) == NULL) {
+        perror("Recorder: Error allocating memory for session files");
+        return 0; }
+
+    // Create detached writer thread
+    if (pthread_attr_init(&attr) ||
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) ||
+            pthread_create(&writer_tid, &attr, record_writer, NULL)) {
+        perror("Recorder: Error creating writer thread");
+        free(rec.files);
+        rec.files = NULL;
+        return 0; }
+    pthread_attr_destroy(&attr);
+
+    // Recorder initialized successfully
+    return 1;
+}
+
+// Function to start a new recording for session
+void record_open(int session)
+{
+    record_push(session, RECORD_OPEN, NULL, 0);
+}
+
+// Function to record data relayed in session; type is RECORD_OUTPUT or RECORD_INPUT
+void record_data(int session, char type, const char *data, size_t len)
+{
+    record_push(session, type, data, len);
+}
+
+// Function to finish session's recording
+void record_close(int session)
+{
+    record_push(session, RECORD_CLOSE, NULL, 0);
+}
+
+// Function to wait until every chunk queued so far is written to its file
+// Only waits for the chunks queued before it was called, so relaying should be stopped first
+void record_drain(void)
+{
+    struct timespec idle = {0, RECORD_IDLE_NSEC};
+    size_t target = __atomic_load_n(&rec.enqueue_pos, __ATOMIC_ACQUIRE);
+
+    if (rec.files == NULL) {
+        return; }
+
+    while ((long)(__atomic_load_n(&rec.flushed_pos, __ATOMIC_ACQUIRE) - target) < 0) {
+        nanosleep(&idle, NULL); }
+}
+
+
+// EOF
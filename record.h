@@ -0,0 +1,21 @@
+// RemoteBASH
+// Session Recorder Header
+
+#include <stddef.h>
+
+// Event types for recorded data, matching asciinema's output and input events
+#define RECORD_OUTPUT 'o'
+#define RECORD_INPUT 'i'
+
+int record_init(const char *dir, int max_sessions);
+
+void record_open(int session);
+
+void record_data(int session, char type, const char *data, size_t len);
+
+void record_close(int session);
+
+void record_drain(void);
+
+
+// EOF
@@ -9,8 +9,13 @@
 #include <sys/wait.h>
 #include <sys/epoll.h>
 #include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
 #include <stdio.h>
+#include <sched.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -20,32 +25,153 @@
 #include <pthread.h>
 #include <time.h>
 #include "tpool.h"
+#include "record.h"
+#ifdef KTLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 
 // Define preprocessor constants for the I/O buffer, port, and shared secret
 #define PORT 4070
 #define SECRET "<rembash>\n"
 #define BUFF_SIZE 4096
+#define RELAY_BUDGET (16*BUFF_SIZE)
+#define DRAIN_TIMEOUT_MS 5000
+#define HANGUP_TIMEOUT_MS 5000
+#define DEADLINE_CHECK_MS 1000
 #define MAX_EVENTS 1
 #define MAX_NUM_CLIENTS 1000
+#define FASTOPEN_QUEUE 16
+#define UPGRADE_TRIES 2
+#define MAX_FDS (MAX_NUM_CLIENTS*3+5)
+
+// Values for fdstate array; each client uses a socket, a pty master, and a pidfd for its bash
+// A pidfd is STATE_DRAIN once its bash is reaped, while the rest of bash's output is relayed,
+// then STATE_EXIT while bash's exit status is sent
+#define STATE_FREE 0
+#define STATE_NEW 1
+#define STATE_SOCKET 2
+#define STATE_MASTER 3
+#define STATE_PIDFD 4
+#define STATE_TLS 5
+#define STATE_DRAIN 6
+#define STATE_EXIT 7
+
+// Tasks and epoll events carry an FD along with its generation, which end_session bumps when it
+// closes a session, so tasks still queued for the session are dropped even if its FDs are reused
+#define FD_BITS 16
+#define TASK(fd) ((fdgen[fd] & 0x7fff) << FD_BITS | (fd))
+#define TASK_FD(task) ((task) & ((1 << FD_BITS) - 1))
+
+// Command line options; encrypted transport options are only in builds with kernel TLS
+// -U UPGRADE_FD is only passed by a running server to the new server it upgrades to
+#ifdef KTLS
+#define OPTIONS "t:c:R:C:K:U:"
+#define USAGE "Usage: server [-t NUM_THREADS] [-c CPU_LIST] [-R RECORDING_DIR] [-C CERT_FILE -K KEY_FILE]\n"
+#else
+#define OPTIONS "t:c:R:U:"
+#define USAGE "Usage: server [-t NUM_THREADS] [-c CPU_LIST] [-R RECORDING_DIR]\n"
+#endif
+
+// Replies from the new server to the upgrade helper once it has received every client
+#define UPGRADE_DONE 'd'
+#define UPGRADE_RETRY 'r'
+
+// Message struct for handing a client to the new server during an upgrade
+// A new client's socket, or a session's socket, pty master, and pidfd, are sent with it
+// along with any data its socket and pty master read that could not be relayed yet, or how much
+// of the secret a new client has sent
+// A session whose bash has exited is sent with its pidfd's state and bash's exit status
+// The last message has state STATE_FREE, the listening socket, the previous server's executable,
+// and the sender's pid
+typedef struct upgrade_msg {
+	int state;
+	pid_t pid;
+	int secret_read;
+	int exit_status;
+	int pending_len[2];
+	char pending[2][BUFF_SIZE];
+} upgrade_msg_t;
 
 // Function prototypes
 void set_up_socket(int *server_sockfd);
 void *event_loop();
 void process_task(int task);
+void relay_task(int task);
 void handle_client(int connect_fd);
-void relay_data(int source, int target);
+int relay_data(int source, int target);
+int flush_pending(int source, int target);
+int wait_writable(int source);
+void hang_up(int fd);
+void rearm_fd(int fd);
+void set_deadline(int pidfd, int timeout_ms);
+void clear_deadline(int pidfd);
+void check_deadlines();
+long now_ms();
+void end_session(int pidfd);
+void drain_session(int task);
+void close_session(int pidfd);
 int check_secret(int connect_fd);
 int set_up_pty(int *master_fd, char **slave_fd);
 void pty_exec_bash(char *slave_name);
 void print_id_info(char *message);
+int parse_cpu_list(char *list, int *cpus);
+void upgrade_server(int server_sockfd, int argc, char **argv);
+int send_clients(int upgrade_fd, int server_sockfd, int exe_fd);
+int adopt_clients(int upgrade_fd, int *exe_fd);
+void roll_back_upgrade(int upgrade_fd, int exe_fd, char **argv);
+int send_fds(int sockfd, upgrade_msg_t *msg, int *fd_list, int num_fds);
+int recv_fds(int sockfd, upgrade_msg_t *msg, int *fd_list, int max_fds);
+#ifdef KTLS
+SSL_CTX *tls_server_ctx(const char *cert_file, const char *key_file);
+void tls_accept(int connect_fd);
+void tls_close(int connect_fd);
+#endif
 
-//Globals for epoll FD and array of socket/pty-master FD pairs
+//Globals for epoll FD, array of socket/pty-master FD pairs, and pidfd of each socket's bash
+//For a pidfd, fds holds the socket FD of its session
 int epfd;
-int fds[MAX_NUM_CLIENTS*2+5];
-int fdstate[MAX_NUM_CLIENTS*2+5];
+int fds[MAX_FDS];
+int fdstate[MAX_FDS];
+int pidfds[MAX_FDS];
+
+//Globals for each FD's generation and whether a worker is relaying from it, guarded by session_mtx
+//session_cv is signalled whenever a worker finishes relaying
+int fdgen[MAX_FDS];
+int fdbusy[MAX_FDS];
+pthread_mutex_t session_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t session_cv = PTHREAD_COND_INITIALIZER;
+
+//Globals for data an FD read that its pair was too full to take, and for the epoll FD that
+//watches those full FDs until they can take more; wepfd is itself watched through epfd
+char *fdpending[MAX_FDS];
+int fdpending_len[MAX_FDS];
+int wepfd;
+
+//Global for the exit status of each draining session's bash, indexed by pidfd
+int fdexit[MAX_FDS];
+
+//Global for how many bytes of the secret each new client has sent so far
+int fdsecret[MAX_FDS];
+
+//Globals for each pidfd's deadline in monotonic ms, or 0 if it has none, guarded by deadline_mtx
+//tfd is a timer that checks deadlines while any are set, and is watched through epfd
+long fddeadline[MAX_FDS];
+int num_deadlines;
+int tfd;
+pthread_mutex_t deadline_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+//Global for the CPUs the server started with, which bash is given instead of a pinned thread's CPU
+cpu_set_t bash_cpus;
 
-int main()
+#ifdef KTLS
+//Globals for TLS context, or NULL if clients are not encrypted, and TLS connection of each socket during handshake
+SSL_CTX *tls_ctx = NULL;
+SSL *tls_ssl[MAX_FDS];
+#endif
+
+
+int main(int argc, char **argv)
 {
 	#ifdef DEBUG
 	print_id_info("Server starting: \n");
@@ -55,62 +181,202 @@ int main()
 	const char * const rembash = "<rembash>\n";
 	int server_sockfd, client_sockfd;
 	pthread_t tid;
+	pthread_attr_t attr;
+
+	// Upgrade variables; upgrade_fd is the socket the previous server hands its clients over
+	int sigfd;
+	int upgrade_fd = -1, exe_fd;
+	sigset_t upgrade_mask;
+	struct signalfd_siginfo siginfo;
+	struct pollfd pfds[2];
+
+	// Thread placement variables; the first CPU in cpus is for the accept and event_loop threads,
+	// and the rest are for thread pool workers
+	int num_threads = 0;
+	int cpus[CPU_SETSIZE];
+	int num_cpus = 0;
+	int opt;
+	cpu_set_t cpuset;
+
+	// Directory for session recordings; NULL means recording is off
+	char *record_dir = NULL;
+	#ifdef KTLS
+	char *cert_file = NULL, *key_file = NULL;
+	#endif
 
-	// Call function to set up server socket
-	set_up_socket(&server_sockfd);
+	// Get thread count, CPU list, recording directory, and TLS files from command line options
+	while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+		switch (opt) {
+		case 't':
+			if ((num_threads = atoi(optarg)) < 1) {
+				fprintf(stderr, "Server: Invalid number of threads: %s\n", optarg);
+				exit(EXIT_FAILURE); }
+			break;
+		case 'c':
+			if ((num_cpus = parse_cpu_list(optarg, cpus)) < 1) {
+				fprintf(stderr, "Server: Invalid CPU list: %s\n", optarg);
+				exit(EXIT_FAILURE); }
+			break;
+		case 'R':
+			record_dir = optarg;
+			break;
+		case 'U':
+			upgrade_fd = atoi(optarg);
+			break;
+		#ifdef KTLS
+		case 'C':
+			cert_file = optarg;
+			break;
+		case 'K':
+			key_file = optarg;
+			break;
+		#endif
+		default:
+			fprintf(stderr, USAGE);
+			exit(EXIT_FAILURE); } }
+
+	#ifdef KTLS
+	// Set up TLS if a certificate and key were given
+	if ((cert_file != NULL) != (key_file != NULL)) {
+		fprintf(stderr, USAGE);
+		exit(EXIT_FAILURE); }
+	if (cert_file != NULL && (tls_ctx = tls_server_ctx(cert_file, key_file)) == NULL) {
+		exit(EXIT_FAILURE); }
+	#endif
+
+	// Block SIGUSR2 in every thread, so upgrade requests are only read from sigfd by the accept loop
+	sigemptyset(&upgrade_mask);
+	sigaddset(&upgrade_mask, SIGUSR2);
+	if (pthread_sigmask(SIG_BLOCK, &upgrade_mask, NULL) ||
+			(sigfd = signalfd(-1, &upgrade_mask, SFD_CLOEXEC|SFD_NONBLOCK)) == -1) {
+		perror("Server: Error setting up upgrade signal");
+		exit(EXIT_FAILURE); }
+
+	// Start session recorder if a recording directory was given
+	if (record_dir != NULL && record_init(record_dir, MAX_FDS) != 1) {
+		fprintf(stderr, "Server: Error starting session recorder\n");
+		exit(EXIT_FAILURE); }
+
+	// Save starting CPUs for bash, then pin accept thread so event_loop thread inherits its CPU
+	if (sched_getaffinity(0, sizeof(bash_cpus), &bash_cpus) == -1) {
+		perror("Server: Error getting CPU affinity");
+		exit(EXIT_FAILURE); }
+	if (num_cpus > 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpus[0], &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)) {
+			fprintf(stderr, "Server: Error pinning threads to CPU %d\n", cpus[0]);
+			exit(EXIT_FAILURE); } }
 
 	// Create epoll unit
 	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
 		perror("Server: Error creating epoll unit");
 		exit(EXIT_FAILURE); }
 
-	// Create thread for event_loop
-	if (pthread_create(&tid, NULL, event_loop, NULL) == -1) {
-		perror("Server: Error creating event_loop thread\n");
+	// Create epoll unit for full FDs, and add it to the main epoll unit
+	struct epoll_event wevent;
+	wevent.events = EPOLLIN;
+	if ((wepfd = epoll_create1(EPOLL_CLOEXEC)) == -1 || (wevent.data.fd = wepfd,
+			epoll_ctl(epfd, EPOLL_CTL_ADD, wepfd, &wevent)) == -1) {
+		perror("Server: Error creating epoll unit for full FDs");
 		exit(EXIT_FAILURE); }
+
+	// Create timer for session deadlines, and add it to the main epoll unit
+	struct epoll_event tevent;
+	tevent.events = EPOLLIN;
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK)) == -1 || (tevent.data.fd = tfd,
+			epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &tevent)) == -1) {
+		perror("Server: Error creating timer for session deadlines");
+		exit(EXIT_FAILURE); }
+
+	// Set up server socket, or take it and all clients over from the server being upgraded
+	if (upgrade_fd == -1) {
+		set_up_socket(&server_sockfd); }
+	else if ((server_sockfd = adopt_clients(upgrade_fd, &exe_fd)) == -1) {
+		roll_back_upgrade(upgrade_fd, exe_fd, argv); }
+
+	// Leave SIGCHLD at its default so exited bash processes can be reaped through their pidfds
+	// Ignore SIGPIPE so writing to a closed socket fails with EPIPE instead of killing the server
+	signal(SIGPIPE, SIG_IGN);
 	
-	// Set SIGCHLD signal to be ignored so don't have to wait for child process
-	signal(SIGCHLD, SIG_IGN);
-	
-	// Initialize thread pool
-	if (tpool_init(process_task) != 1) {
+	// Initialize thread pool, giving workers their own CPUs if more than one was listed
+	// Clients taken over in an upgrade may have events ready, so it is started before event_loop
+	if (tpool_init(process_task, num_threads, num_cpus > 1 ? cpus+1 : cpus, num_cpus > 1 ? num_cpus-1 : num_cpus) != 1) {
 		perror("Server: Error initializing thread pool");
 		exit(EXIT_FAILURE); }
 
-	// Accept and client handling loop
+	// Create thread for event_loop
+	pthread_attr_init(&attr);
+	if (num_cpus > 0) {
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset); }
+	if (pthread_create(&tid, &attr, event_loop, NULL)) {
+		perror("Server: Error creating event_loop thread\n");
+		exit(EXIT_FAILURE); }
+	pthread_attr_destroy(&attr);
+
+	// Accept and client handling loop, which also waits for upgrade requests
+	pfds[0].fd = server_sockfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = sigfd;
+	pfds[1].events = POLLIN;
 	while (1) {
 		
 		#ifdef DEBUG
 		printf("before accept\n");
 		#endif
 		
-		// Accept connections from clients and handle them
-		if ((client_sockfd = accept4(server_sockfd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK)) != -1) {
+		// Wait for a connection or SIGUSR2
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue; }
+			perror("Server: poll call failed");
+			exit(EXIT_FAILURE); }
+
+		// SIGUSR2 received, so hand all clients to a newly started server; returns only on failure
+		if (pfds[1].revents & POLLIN) {
+			while (read(sigfd, &siginfo, sizeof(siginfo)) > 0);
+			upgrade_server(server_sockfd, argc, argv); }
+		
+		// Accept every pending connection from clients and handle them, so the listen queue does not
+		// overflow and leave clients that are waiting for the rembash message connected to nothing
+		while ((client_sockfd = accept4(server_sockfd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK)) != -1) {
 			#ifdef DEBUG
-			printf("after accept\n");
+			int rx_cpu;
+			socklen_t len = sizeof(rx_cpu);
+			if (getsockopt(client_sockfd, SOL_SOCKET, SO_INCOMING_CPU, &rx_cpu, &len) == 0) {
+				printf("after accept (RX on CPU %d)\n", rx_cpu); }
 			#endif
 			
 			// Check if space for client
-			if (client_sockfd >= 2 * MAX_NUM_CLIENTS + 5) {
+			if (client_sockfd >= MAX_FDS) {
 				close(client_sockfd);
-				break; }
+				continue; }
 			
-			// Add client FD to state array; 0 means before secret
-			fdstate[client_sockfd] = 0;
+			// Add client FD to state array as new client that has not sent secret
+			// Encrypted clients must finish the TLS handshake first
+			fdstate[client_sockfd] = STATE_NEW;
+			fdsecret[client_sockfd] = 0;
+			#ifdef KTLS
+			if (tls_ctx != NULL) {
+				fdstate[client_sockfd] = STATE_TLS; }
+			#endif
+			
+			// Write initial rembash message to client, unless it is sent after the TLS handshake
+			// Fast open clients may have sent their secret already, so it is written before a worker
+			// can read the secret and write ok
+			if (fdstate[client_sockfd] == STATE_NEW && write(client_sockfd, rembash, strlen(rembash)) == -1) {
+				perror("Server: Error writing rembash to socket");
+				fdstate[client_sockfd] = STATE_FREE;
+				close(client_sockfd);
+				continue; }
 			
 			// Add client FD to epoll interest list
 			struct epoll_event event;
-			event.events = EPOLLIN|EPOLLET;
-			event.data.fd = client_sockfd;
+			event.events = EPOLLIN|EPOLLET|EPOLLONESHOT;
+			event.data.fd = TASK(client_sockfd);
 			if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_sockfd, &event) == -1) {
 				perror("Server: Error adding client_sockfd to epoll interest list");
-				pthread_exit(NULL); }
-			
-			// Write initial rembash message to client
-			if (write(client_sockfd, rembash, strlen(rembash)) == -1) {
-				perror("Server: Error writing rembash to socket");
-				close(client_sockfd);
-				continue; } }
+				pthread_exit(NULL); } }
 	}
 
 	// Program should not get here, so exit with failure if it does
@@ -123,8 +389,8 @@ void set_up_socket(int *server_sockfd)
 	// Struct for server
 	struct sockaddr_in server_address;
 
-	// Create socket for server
-	if ((*server_sockfd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1) {
+	// Create socket for server; accept loop polls it, so it does not block
+	if ((*server_sockfd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0)) == -1) {
 		perror("Server: socket call failed");
 		exit(EXIT_FAILURE); }
 
@@ -132,6 +398,10 @@ void set_up_socket(int *server_sockfd)
 	int i = 1;
 	setsockopt(*server_sockfd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
 
+	// Let fast open clients send their secret with the connection request, if the kernel allows it
+	i = FASTOPEN_QUEUE;
+	setsockopt(*server_sockfd, IPPROTO_TCP, TCP_FASTOPEN, &i, sizeof(i));
+
 	// Set up server struct for TCP, PORT, and any IP Address
 	memset(&server_address, 0, sizeof(server_address));
 	server_address.sin_family = AF_INET;
@@ -144,7 +414,7 @@ void set_up_socket(int *server_sockfd)
 		exit(EXIT_FAILURE); }
 
 	// Set up listening socket, ignore child exit status, and loop for connections
-	if (listen(*server_sockfd, 10) == -1) {
+	if (listen(*server_sockfd, SOMAXCONN) == -1) {
 		perror("Server: listen call failed");
 		exit(EXIT_FAILURE); }
 
@@ -161,6 +431,8 @@ void *event_loop()
 	int ready_fds;
 	struct epoll_event current_event;
 	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event wevent;
+	int task, fd;
 	
 	#ifdef DEBUG
 	printf("before epoll_wait\n");
@@ -174,30 +446,51 @@ void *event_loop()
 		
 		// Loop through ready FDs and relay data
 		for (int i=0; i < ready_fds; i++) {
-			// Get current event from returned epoll events struct
+			// Get current event from returned epoll events struct, and the task and FD it is for
 			current_event = events[i];
+			task = current_event.data.fd;
+			fd = TASK_FD(task);
 			
-			// If error or no data to read after epoll_wait, then close FDs
-			if (current_event.events & (EPOLLHUP|EPOLLERR|EPOLLRDHUP)) {
+			// If full FDs can take more data, add the FDs waiting to relay to them to task queue
+			if (fd == wepfd) {
+				while (epoll_wait(wepfd, &wevent, 1, 0) > 0) {
+					if (tpool_add_task(wevent.data.fd, TPOOL_PRIO_LOW) != 1) {
+						perror("Server: Failed to add client to task queue");
+						hang_up(TASK_FD(wevent.data.fd)); } } }
+
+			// If timer expired, act on sessions whose deadline has passed
+			else if (fd == tfd) {
+				check_deadlines(); }
+
+			// If pidfd is readable, bash has exited, so add session teardown to task queue
+			else if (fdstate[fd] == STATE_PIDFD) {
 				#ifdef DEBUG
-				printf("\nClient closed using \"exit\"\n");
-				printf("Closing FDs %d and %d...\n\n", fds[current_event.data.fd], current_event.data.fd);
+				printf("Bash exited for client (FD %d)\n", fds[fd]);
 				#endif
+				if (tpool_add_task(task, TPOOL_PRIO_HIGH) != 1) {
+					perror("Server: Failed to add session teardown to task queue"); } }
 
-				// Close current FDs to avoid leaks
-				close(fds[current_event.data.fd]);
-				close(current_event.data.fd); }
+			// If error or no data to read after epoll_wait, then stop watching FD
+			// unless its session was closed since the event was reported
+			else if (current_event.events & (EPOLLHUP|EPOLLERR|EPOLLRDHUP)) {
+				#ifdef DEBUG
+				printf("\nFD %d hung up\n", fd);
+				#endif
+				pthread_mutex_lock(&session_mtx);
+				if (task == TASK(fd)) {
+					hang_up(fd); }
+				pthread_mutex_unlock(&session_mtx); }
 
 			// Check if data available for read
 			else if (current_event.events & EPOLLIN) {
 				#ifdef DEBUG
-				printf("Adding FD %d to task queue\n", current_event.data.fd);
+				printf("Adding FD %d to task queue\n", fd);
 				#endif
-				// Add client to task queue
-				if (tpool_add_task(current_event.data.fd) != 1) {
+				// Add client to task queue; new input and output go in the high priority lane, ahead of
+				// sessions requeued with more bulk data
+				if (tpool_add_task(task, TPOOL_PRIO_HIGH) != 1) {
 					perror("Server: Failed to add client to task queue");
-					close(fds[current_event.data.fd]);
-					close(current_event.data.fd); } }
+					hang_up(fd); } }
 		}
 	}
 
@@ -211,11 +504,65 @@ void process_task(int task)
 	#ifdef DEBUG
 	printf("Processing task %d:\n", task);
 	#endif
-	if (fdstate[task] == 0) {
-		handle_client(task);
-		fdstate[task] = 1; }
+	int fd = TASK_FD(task);
+
+	// FD was closed, or its session was closed and the FD reused, after the task was queued
+	if (fdstate[fd] == STATE_FREE || task != TASK(fd)) {
+		return; }
+	else if (fdstate[fd] == STATE_NEW) {
+		handle_client(fd); }
+	else if (fdstate[fd] == STATE_PIDFD) {
+		end_session(fd); }
+	else if (fdstate[fd] == STATE_DRAIN || fdstate[fd] == STATE_EXIT) {
+		drain_session(task); }
+	#ifdef KTLS
+	else if (fdstate[fd] == STATE_TLS) {
+		tls_accept(fd); }
+	#endif
+	else {
+		relay_task(task); }
+}
+
+// Function to run one relay pass for a session FD, then requeue or rearm it
+// The FD is marked busy during the pass, so end_session waits for it before closing the session
+void relay_task(int task)
+{
+	int fd = TASK_FD(task);
+	int status;
+
+	// Check that session was not closed since the stale check in process_task
+	pthread_mutex_lock(&session_mtx);
+	if (task != TASK(fd)) {
+		pthread_mutex_unlock(&session_mtx);
+		return; }
+	fdbusy[fd] = 1;
+	pthread_mutex_unlock(&session_mtx);
+
+	status = relay_data(fd, fds[fd]);
+
+	// Hand FD back to epoll or task queue, unless end_session is waiting to close it
+	pthread_mutex_lock(&session_mtx);
+	fdbusy[fd] = 0;
+	if (task != TASK(fd)) {
+		pthread_cond_broadcast(&session_cv); }
+	else if (status == -1) {
+		hang_up(fd); }
+
+	// Budget spent with data left, so requeue as bulk data behind other sessions' tasks
+	else if (status == 1) {
+		if (tpool_add_task(task, TPOOL_PRIO_LOW) != 1) {
+			perror("Server: Failed to requeue relay task");
+			hang_up(fd); } }
+
+	// Target is full, so leave source unarmed until target can take the rest
+	else if (status == 2) {
+		if (wait_writable(fd) == -1) {
+			hang_up(fd); } }
+
+	// Source drained, so let epoll report it again
 	else {
-		relay_data(task, fds[task]); }
+		rearm_fd(fd); }
+	pthread_mutex_unlock(&session_mtx);
 }
 
 void handle_client(int connect_fd)
@@ -225,9 +572,9 @@ void handle_client(int connect_fd)
 	#endif
 
 	const char * const ok = "<ok>\n";
-	const char * const err = "<error>\n";
 	char *slave_name;
-	int master_fd;
+	int master_fd, pidfd;
+	pid_t pid;
 	char input[513];
 	ssize_t nread;
 	
@@ -235,28 +582,52 @@ void handle_client(int connect_fd)
 	printf("Reading secret from new client (FD %d)\n", connect_fd);
 	#endif
 
-	// Get secret from client
-	if ((nread = read(connect_fd, input, 512)) == -1 && nread != EAGAIN) {
-		perror("Server: Error reading SECRET from socket");
-		write(connect_fd, err, strlen(err));
-		close(connect_fd); }
+	// Get secret from client, which may arrive over several reads; if not all of it has, wait for next event
+	switch (check_secret(connect_fd)) {
+	case 0:
+		rearm_fd(connect_fd);
+		return;
+	case -1:
+		fdsecret[connect_fd] = 0;
+		fdstate[connect_fd] = STATE_FREE;
+		close(connect_fd);
+		return; }
+	fdsecret[connect_fd] = 0;
 
-	// Check that new message from client is valid secret
-	input[nread] = '\0';
-	if (strcmp(input, SECRET)) {
-		fprintf(stderr, "Server: Invalid secret received: %s", input);
-		close(connect_fd); }
+	// Fast open clients send their first input right after the secret, without waiting for the rembash message
+	if ((nread = read(connect_fd, input, 512)) == -1) {
+		if (errno != EAGAIN) {
+			perror("Server: Error reading first input from socket");
+			fdstate[connect_fd] = STATE_FREE;
+			close(connect_fd);
+			return; }
+		nread = 0; }
 
 	// Set up pty master/slave pair
 	if (set_up_pty(&master_fd, &slave_name)) {
-		close(connect_fd); }
+		fdstate[connect_fd] = STATE_FREE;
+		close(connect_fd);
+		return; }
+
+	// Check if space for pty master in FD arrays
+	if (master_fd >= MAX_FDS) {
+		fprintf(stderr, "Server: No space for pty master of client (FD %d)\n", connect_fd);
+		free(slave_name);
+		fdstate[connect_fd] = STATE_FREE;
+		close(connect_fd);
+		close(master_fd);
+		return; }
 
 	// Fork child process and exec bash
 	// Fork subprocess
-	switch (fork()) {
+	switch (pid = fork()) {
 	case -1: // Fork failed
 		perror("Server: fork call failed");
+		free(slave_name);
+		fdstate[connect_fd] = STATE_FREE;
 		close(connect_fd);
+		close(master_fd);
+		return;
 
 	case 0: // Child process
 		#ifdef DEBUG
@@ -265,6 +636,13 @@ void handle_client(int connect_fd)
 		
 		close(connect_fd);
 		close(master_fd);
+		
+		// Let bash run on any CPU the server started with, not only the forking worker's CPU
+		// and do not pass on the server's blocked upgrade signal
+		sched_setaffinity(0, sizeof(bash_cpus), &bash_cpus);
+		sigset_t empty_mask;
+		sigemptyset(&empty_mask);
+		sigprocmask(SIG_SETMASK, &empty_mask, NULL);
 		pty_exec_bash(slave_name);
 		
 		// Make sure child process exits
@@ -272,28 +650,75 @@ void handle_client(int connect_fd)
 	}
 	
 	// Parent Process
+	free(slave_name);
 	
-	fdstate[connect_fd] = 1;
-	fdstate[master_fd] = 1;
+	// Get pidfd for bash so its exit can be tracked in the epoll unit
+	if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) == -1) {
+		perror("Server: Error opening pidfd for bash");
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		fdstate[connect_fd] = STATE_FREE;
+		close(connect_fd);
+		close(master_fd);
+		return; }
+
+	// Check if space for pidfd in FD arrays; bash cannot be tracked without it, so end it
+	if (pidfd >= MAX_FDS) {
+		fprintf(stderr, "Server: No space for pidfd of client (FD %d)\n", connect_fd);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		fdstate[connect_fd] = STATE_FREE;
+		close(connect_fd);
+		close(master_fd);
+		close(pidfd);
+		return; }
 	
-	// Store connect_fd and master_fd in FD array
+	fdstate[connect_fd] = STATE_SOCKET;
+	fdstate[master_fd] = STATE_MASTER;
+	fdstate[pidfd] = STATE_PIDFD;
+	
+	// Store connect_fd and master_fd in FD array, and link pidfd with its socket
 	fds[connect_fd] = master_fd;
 	fds[master_fd] = connect_fd;
+	fds[pidfd] = connect_fd;
+	pidfds[connect_fd] = pidfd;
 	
-	// Add master FD to the epoll interest list
+	// Add pidfd to the epoll interest list first, so any later failure can be torn down through it
+	// One-shot, so exactly one teardown task is queued when bash exits
 	struct epoll_event event;
-	event.events = EPOLLIN|EPOLLET;
-	event.data.fd = master_fd;
-	if (epoll_ctl(epfd, EPOLL_CTL_ADD, master_fd, &event) == -1) {
-		perror("Server: Error adding master_fd to epoll interest list");
-		close(connect_fd);
-		close(master_fd); }
+	event.events = EPOLLIN|EPOLLONESHOT;
+	event.data.fd = TASK(pidfd);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+		perror("Server: Error adding pidfd to epoll interest list");
+		kill(pid, SIGKILL);
+		end_session(pidfd);
+		return; }
+	
+	// Start recording before any of the session's data is relayed
+	record_open(connect_fd);
 	
-	// Write ok to client
+	// Write ok to client before the master FD is watched, so no bash output can be relayed ahead of it
 	if (write(connect_fd, ok, strlen(ok)) == -1) {
 		perror("Server: Error writing OK to socket");
-		close(connect_fd);
-		close(master_fd); }
+		hang_up(connect_fd);
+		return; }
+	
+	// Pass input sent along with the secret to bash; the pty holds it until bash reads it
+	if (nread > 0) {
+		record_data(connect_fd, RECORD_INPUT, input, nread);
+		if (write(master_fd, input, nread) == -1) {
+			perror("Server: Error writing first input to pty master"); } }
+	
+	// Add master FD to the epoll interest list
+	event.events = EPOLLIN|EPOLLET|EPOLLONESHOT;
+	event.data.fd = TASK(master_fd);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, master_fd, &event) == -1) {
+		perror("Server: Error adding master_fd to epoll interest list");
+		hang_up(connect_fd);
+		return; }
+	
+	// Let epoll report client input now that bash is running
+	rearm_fd(connect_fd);
 
 	#ifdef DEBUG
 	printf("Finished protocol exchange for new client (FD %d)\n\n", connect_fd);
@@ -303,7 +728,12 @@ void handle_client(int connect_fd)
 	return;
 }
 
-void relay_data(int source, int target)
+// Function to relay data from source FD to target FD until source has no more data
+// Each call relays at most RELAY_BUDGET bytes, so one busy session cannot hold a worker
+// If target is full, the data it did not take is kept and sent first on the next call
+// Returns 0 once source would block, 1 if budget was spent first, 2 if target is full,
+// or -1 on EOF or error
+int relay_data(int source, int target)
 {
 	#ifdef DEBUG
 	printf("Relaying data: %d -> %d\n", source, target);
@@ -312,39 +742,376 @@ void relay_data(int source, int target)
 	// Variables for I/O
 	char buff[BUFF_SIZE];
 	ssize_t nread, nwritten, total;
+	ssize_t budget = RELAY_BUDGET;
+	
+	// Recordings are kept by socket FD; data from the pty master is bash output
+	int session = (fdstate[source] == STATE_MASTER) ? target : source;
+	char type = (fdstate[source] == STATE_MASTER) ? RECORD_OUTPUT : RECORD_INPUT;
+	
+	// Send data target did not take on the last call before reading more
+	if (fdpending_len[source] > 0 && flush_pending(source, target)) {
+		return 2; }
 	
 	// Relay data from current_event FD to its pair
 	errno = 0;
 	while ((nread = read(source, buff, BUFF_SIZE)) > 0) {
+		record_data(session, type, buff, nread);
 		total = 0;
 		do {
 		if ((nwritten = write(target,buff+total,nread-total)) == -1) break;
 			total += nwritten;
-		} while (total < nread); }
+		} while (total < nread);
+		
+		// Target is full, so keep the rest and stop until it can take more
+		if (nwritten == -1 && errno == EAGAIN) {
+			if (fdpending[source] == NULL && (fdpending[source] = malloc(BUFF_SIZE)) == NULL) {
+				perror("Server: Failed to allocate memory for pending data");
+				return -1; }
+			memcpy(fdpending[source], buff+total, nread-total);
+			fdpending_len[source] = nread-total;
+			return 2; }
+		
+		// Stop once this pass's budget is spent so other sessions get a turn
+		if ((budget -= nread) <= 0) {
+			return 1; } }
 
-	// Check if error or EOF encountered and close FDs
+	// Check if error or EOF encountered
 	if (nread < 1 && errno != EAGAIN) {
 		#ifdef DEBUG
 		if (errno)
 			perror("Server: Error reading from current_event FD:");
 		else
 			printf("\nClient closed using \"Ctrl + C\"\n");
-		printf("Closing FDs %d and %d...\n\n", source, target);
+		printf("FD %d finished relaying to FD %d\n\n", source, target);
 		#endif
 
-		// Close current FDs to avoid leaks
-		close(source);
-		close(target); }
+		return -1; }
 		
-		return;
+		return 0;
+}
+
+// Function to write data source read earlier that target was too full to take
+// Data is dropped if target fails, as relay_data does with data it reads
+// Returns 0 once all of it is written, or 1 if target is still full
+int flush_pending(int source, int target)
+{
+	ssize_t nwritten;
+	int total = 0;
+
+	while (total < fdpending_len[source]) {
+		if ((nwritten = write(target, fdpending[source]+total, fdpending_len[source]-total)) == -1) {
+			if (errno != EAGAIN) {
+				break; }
+			memmove(fdpending[source], fdpending[source]+total, fdpending_len[source]-total);
+			fdpending_len[source] -= total;
+			return 1; }
+		total += nwritten; }
+
+	fdpending_len[source] = 0;
+	return 0;
+}
+
+// Function to wait for a source's full target to take more data before relaying again
+// The target is watched in wepfd for the source, which stays unarmed in epfd until then
+// Returns 0 on success or -1 on failure
+int wait_writable(int source)
+{
+	struct epoll_event event;
+	event.events = EPOLLOUT|EPOLLONESHOT;
+	event.data.fd = TASK(source);
+	if (epoll_ctl(wepfd, EPOLL_CTL_MOD, fds[source], &event) == -1 &&
+			(errno != ENOENT || epoll_ctl(wepfd, EPOLL_CTL_ADD, fds[source], &event) == -1)) {
+		perror("Server: Error adding full FD to epoll interest list");
+		return -1; }
+
+	return 0;
+}
+
+// Function to stop watching a socket or pty master that hung up
+// Sessions are only closed by end_session, once the pidfd reports that bash has exited
+void hang_up(int fd)
+{
+	// Client never finished protocol exchange, so there is no bash to wait for
+	if (fdstate[fd] == STATE_NEW) {
+		fdsecret[fd] = 0;
+		fdstate[fd] = STATE_FREE;
+		close(fd);
+		return; }
+	#ifdef KTLS
+	if (fdstate[fd] == STATE_TLS) {
+		tls_close(fd);
+		return; }
+	#endif
+
+	// Remove FD from epoll interest list so it stops reporting events
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	// If client is gone, hang up its bash so the pidfd becomes readable, and kill it if it
+	// has not exited by the deadline, since it may ignore SIGHUP and wait on the pty forever
+	if (fdstate[fd] == STATE_SOCKET) {
+		if (syscall(SYS_pidfd_send_signal, pidfds[fd], SIGHUP, NULL, 0) == -1) {
+			perror("Server: Error sending SIGHUP to bash"); }
+		set_deadline(pidfds[fd], HANGUP_TIMEOUT_MS); }
+
+	return;
+}
+
+// Function to re-enable a one-shot FD in the epoll interest list after it was drained
+// Only one worker handles an FD at a time, since epoll disables it until it is rearmed
+// An FD taken over during an upgrade with data pending is only added once that data is sent
+void rearm_fd(int fd)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN|EPOLLET|EPOLLONESHOT;
+	event.data.fd = TASK(fd);
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event) == -1 &&
+			(errno != ENOENT || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1)) {
+		perror("Server: Error rearming FD in epoll interest list");
+		hang_up(fd); }
+
+	return;
+}
+
+// Function to give a session a deadline, unless it has one already, and start the timer if needed
+void set_deadline(int pidfd, int timeout_ms)
+{
+	struct itimerspec its = {{DEADLINE_CHECK_MS / 1000, DEADLINE_CHECK_MS % 1000 * 1000000L},
+			{DEADLINE_CHECK_MS / 1000, DEADLINE_CHECK_MS % 1000 * 1000000L}};
+
+	pthread_mutex_lock(&deadline_mtx);
+	if (fddeadline[pidfd] == 0) {
+		fddeadline[pidfd] = now_ms() + timeout_ms;
+		if (num_deadlines++ == 0 && timerfd_settime(tfd, 0, &its, NULL) == -1) {
+			perror("Server: Error starting deadline timer"); } }
+	pthread_mutex_unlock(&deadline_mtx);
+
+	return;
+}
+
+// Function to remove a session's deadline, and stop the timer once no session has one
+void clear_deadline(int pidfd)
+{
+	struct itimerspec its = {{0, 0}, {0, 0}};
+
+	pthread_mutex_lock(&deadline_mtx);
+	if (fddeadline[pidfd] != 0) {
+		fddeadline[pidfd] = 0;
+		if (--num_deadlines == 0) {
+			timerfd_settime(tfd, 0, &its, NULL); } }
+	pthread_mutex_unlock(&deadline_mtx);
+
+	return;
+}
+
+// Function to kill the bash of every session whose client hung up and whose deadline has passed,
+// and to have a worker close every session whose output was not drained by its deadline
+// Deadlines are cleared before their pidfd is closed, so a pidfd with a deadline is still open
+void check_deadlines()
+{
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	uint64_t expirations;
+	long now = now_ms();
+
+	read(tfd, &expirations, sizeof(expirations));
+	pthread_mutex_lock(&deadline_mtx);
+	for (int fd=0; fd < MAX_FDS; fd++) {
+		if (fddeadline[fd] == 0 || now < fddeadline[fd]) {
+			continue; }
+
+		// Draining session keeps its deadline until close_session, so it is queued again on
+		// each check until a worker closes it
+		if (fdstate[fd] == STATE_DRAIN || fdstate[fd] == STATE_EXIT) {
+			if (tpool_add_task(TASK(fd), TPOOL_PRIO_HIGH) != 1) {
+				perror("Server: Failed to add session teardown to task queue"); }
+			continue; }
+
+		#ifdef DEBUG
+		printf("Bash for client (FD %d) did not exit after hang up, so killing it\n", fds[fd]);
+		#endif
+		if (syscall(SYS_pidfd_send_signal, fd, SIGKILL, NULL, 0) == -1) {
+			perror("Server: Error sending SIGKILL to bash"); }
+		fddeadline[fd] = 0;
+		num_deadlines--; }
+
+	// Stop timer once no session has a deadline
+	if (num_deadlines == 0) {
+		timerfd_settime(tfd, 0, &its, NULL); }
+	pthread_mutex_unlock(&deadline_mtx);
+
+	return;
+}
+
+// Function to get monotonic clock time in milliseconds
+long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Function to reap a session's bash, then start relaying the rest of its output to the client
+void end_session(int pidfd)
+{
+	int connect_fd = fds[pidfd];
+	int master_fd = fds[connect_fd];
+	int status = -1;
+	siginfo_t info;
+
+	// Reap bash and get its exit status; signals are reported as 128+signal, like bash does
+	memset(&info, 0, sizeof(info));
+	if (waitid(P_PIDFD, pidfd, &info, WEXITED) == -1) {
+		perror("Server: Error reaping bash"); }
+	else if (info.si_code == CLD_EXITED) {
+		status = info.si_status; }
+	else {
+		status = 128 + info.si_status; }
+
+	#ifdef DEBUG
+	printf("Draining FDs %d, %d, and %d (exit status %d)...\n\n", connect_fd, master_fd, pidfd, status);
+	#endif
+
+	// Bash has exited, so it no longer needs killing after a hang up
+	clear_deadline(pidfd);
+
+	// Drop tasks still queued for the session, and wait for any relay pass running on its FDs
+	pthread_mutex_lock(&session_mtx);
+	fdgen[connect_fd]++;
+	fdgen[master_fd]++;
+	while (fdbusy[connect_fd] || fdbusy[master_fd]) {
+		pthread_cond_wait(&session_cv, &session_mtx); }
+	fdexit[pidfd] = status;
+	fdstate[pidfd] = STATE_DRAIN;
+	pthread_mutex_unlock(&session_mtx);
+
+	// Give the client a while to take the rest of bash's output
+	set_deadline(pidfd, DRAIN_TIMEOUT_MS);
+	drain_session(TASK(pidfd));
+
+	return;
+}
+
+// Function to run one pass relaying output bash wrote before exiting, then requeue the session
+// or wait for a full socket, as relay_task does, so a slow client does not hold a worker
+// Once the output is drained, bash's exit status is sent after it the same way
+// The session is closed once its exit status is sent, or once its deadline passes
+void drain_session(int task)
+{
+	const char * const exit_msg = "\r\n<exit %d>\r\n";
+	int pidfd = TASK_FD(task);
+	int connect_fd = fds[pidfd];
+	int master_fd = fds[connect_fd];
+	int status = -1;
+	int expired;
+
+	// Only one worker drains a session at a time, since check_deadlines may queue it again
+	pthread_mutex_lock(&session_mtx);
+	if (task != TASK(pidfd) || fdbusy[pidfd]) {
+		pthread_mutex_unlock(&session_mtx);
+		return; }
+	fdbusy[pidfd] = 1;
+	pthread_mutex_unlock(&session_mtx);
+
+	pthread_mutex_lock(&deadline_mtx);
+	expired = now_ms() >= fddeadline[pidfd];
+	pthread_mutex_unlock(&deadline_mtx);
+	if (!expired && fdstate[pidfd] == STATE_DRAIN) {
+		status = relay_data(master_fd, connect_fd); }
+
+	// Output drained, so queue exit status as data the socket has not taken yet; past the
+	// deadline, any output left is dropped and the exit status is sent if the socket can take it
+	if ((status == 0 || status == -1) && fdstate[pidfd] == STATE_DRAIN &&
+			(fdpending[master_fd] != NULL || (fdpending[master_fd] = malloc(BUFF_SIZE)) != NULL)) {
+		fdpending_len[master_fd] = snprintf(fdpending[master_fd], BUFF_SIZE, exit_msg, fdexit[pidfd]);
+		fdstate[pidfd] = STATE_EXIT; }
+	if (fdstate[pidfd] == STATE_EXIT) {
+		status = (flush_pending(master_fd, connect_fd) && !expired) ? 2 : 0; }
+
+	// Budget spent with output left, so requeue as bulk data behind other sessions' tasks
+	// Socket is full, so wait for it to take more; wepfd watches fds[pidfd], the socket
+	pthread_mutex_lock(&session_mtx);
+	fdbusy[pidfd] = 0;
+	if ((status == 1 && tpool_add_task(task, TPOOL_PRIO_LOW) == 1) || (status == 2 && wait_writable(pidfd) == 0)) {
+		pthread_mutex_unlock(&session_mtx);
+		return; }
+	pthread_mutex_unlock(&session_mtx);
+
+	// Exit status sent, client gone, or deadline passed
+	close_session(pidfd);
+
+	return;
+}
+
+// Function to close all of a session's FDs
+void close_session(int pidfd)
+{
+	int connect_fd = fds[pidfd];
+	int master_fd = fds[connect_fd];
+
+	#ifdef DEBUG
+	printf("Closing FDs %d, %d, and %d...\n\n", connect_fd, master_fd, pidfd);
+	#endif
+
+	record_close(connect_fd);
+
+	// Drop tasks still queued for the session, including any check_deadlines queued
+	pthread_mutex_lock(&session_mtx);
+	fdgen[pidfd]++;
+	pthread_mutex_unlock(&session_mtx);
+	clear_deadline(pidfd);
+
+	// Close all session FDs to avoid leaks
+	fdstate[connect_fd] = STATE_FREE;
+	fdstate[master_fd] = STATE_FREE;
+	fdstate[pidfd] = STATE_FREE;
+	fdpending_len[connect_fd] = 0;
+	fdpending_len[master_fd] = 0;
+	free(fdpending[connect_fd]);
+	free(fdpending[master_fd]);
+	fdpending[connect_fd] = NULL;
+	fdpending[master_fd] = NULL;
+	close(connect_fd);
+	close(master_fd);
+	close(pidfd);
+
+	return;
+}
+
+// Function to read the secret from a new client, which may send it over several reads
+// Only bytes up to the end of the secret are read, so any first input is left on the socket
+// Returns 1 once the whole secret has arrived, 0 if more is still to come, or -1 if it is invalid
+int check_secret(int connect_fd)
+{
+	const char * const err = "<error>\n";
+	size_t secret_len = strlen(SECRET);
+	char input[sizeof(SECRET)];
+	ssize_t nread;
+
+	while ((size_t)fdsecret[connect_fd] < secret_len) {
+		if ((nread = read(connect_fd, input, secret_len - fdsecret[connect_fd])) < 1) {
+			if (nread == -1 && errno == EAGAIN) {
+				return 0; }
+			perror("Server: Error reading SECRET from socket");
+			write(connect_fd, err, strlen(err));
+			return -1; }
+
+		// Check that bytes read so far match the secret
+		input[nread] = '\0';
+		if (strncmp(input, SECRET + fdsecret[connect_fd], nread)) {
+			fprintf(stderr, "Server: Invalid secret received: %s", input);
+			return -1; }
+		fdsecret[connect_fd] += nread; }
+
+	return 1;
 }
 
 // Function to set up pty and open master and slave FDs
 int set_up_pty(int *master_fd, char **slave_name)
 {
 	// Variables for pty slave name
-	char *temp_name;
+	char temp_name[64];
 	char *sname;
+	int err;
 
 	// Open pty master and get its file descriptor
 	if ((*master_fd = posix_openpt(O_RDWR|O_CLOEXEC|O_NONBLOCK)) == -1) {
@@ -363,17 +1130,17 @@ int set_up_pty(int *master_fd, char **slave_name)
 		close(*master_fd);
 		return 1; }
 
-	// Get the pty slave name
-	if ((temp_name = ptsname(*master_fd)) == NULL) {
-		if (errno) {
-			perror("Server: ptsname call failed"); }
-		else {
-			fprintf(stderr, "Server: ptsname call returned NULL\n"); }
+	// Get the pty slave name; ptsname_r is used since workers set up ptys at the same time,
+	// and ptsname returns its name in a buffer they would share
+	if ((err = ptsname_r(*master_fd, temp_name, sizeof(temp_name))) != 0) {
+		errno = err;
+		perror("Server: ptsname_r call failed");
 		close(*master_fd);
 		return 1; }
 
 	if ((sname = malloc(strlen(temp_name)+1)) == NULL) {
 		perror("Server: Failed to allocate memory for slave_name");
+		close(*master_fd);
 		return 1; }
 	strcpy(sname, temp_name);
 	*slave_name = sname;
@@ -420,6 +1187,467 @@ void pty_exec_bash(char *slave_name)
 }
 
 
+// Function to parse a CPU list such as "0,2,4-7" into cpus
+// Returns number of CPUs parsed, or -1 if list is invalid
+int parse_cpu_list(char *list, int *cpus)
+{
+	int num_cpus = 0;
+	int first, last;
+	char *range, *saveptr;
+
+	// Loop through comma separated CPUs and CPU ranges
+	for (range = strtok_r(list, ",", &saveptr); range != NULL; range = strtok_r(NULL, ",", &saveptr)) {
+		switch (sscanf(range, "%d-%d", &first, &last)) {
+		case 1:
+			last = first;
+			break;
+		case 2:
+			break;
+		default:
+			return -1; }
+		if (first < 0 || last >= CPU_SETSIZE || first > last) {
+			return -1; }
+		for (int cpu=first; cpu <= last && num_cpus < CPU_SETSIZE; cpu++) {
+			cpus[num_cpus++] = cpu; }
+	}
+
+	return num_cpus;
+}
+
+// Function to replace the server with a new process running the server binary, keeping all clients
+// A forked helper sends the listening socket and every client's FDs and state to the new server,
+// while this process execs it in place, so each bash stays a child of the server that reaps it
+// The helper keeps its copies of the FDs until the new server reports it took over every client,
+// and sends them again if the new server fails and starts this server's executable again instead
+// Returns only if the upgrade failed, with the old server still running
+void upgrade_server(int server_sockfd, int argc, char **argv)
+{
+	int sv[2];
+	int exe_fd;
+	char reply;
+	pid_t pid;
+	char fd_arg[16];
+	char **new_argv;
+	cpu_set_t accept_cpus;
+
+	#ifdef DEBUG
+	printf("Upgrading server\n");
+	#endif
+
+	// Open this server's executable, so it can be started again if the new server fails
+	if ((exe_fd = open("/proc/self/exe", O_RDONLY|O_CLOEXEC)) == -1) {
+		perror("Server: Error opening server executable");
+		return; }
+
+	// Create socket pair for the handoff; only the new server's end is kept across exec
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("Server: Error creating upgrade socket pair");
+		close(exe_fd);
+		return; }
+
+	// Build new server's arguments from this server's, replacing any upgrade FD it was given
+	if ((new_argv = malloc((argc+3) * sizeof(char *))) == NULL) {
+		perror("Server: Failed to allocate memory for upgrade arguments");
+		close(exe_fd);
+		close(sv[0]);
+		close(sv[1]);
+		return; }
+	snprintf(fd_arg, sizeof(fd_arg), "%d", sv[0]);
+	new_argv[0] = argv[0];
+	new_argv[1] = "-U";
+	new_argv[2] = fd_arg;
+	int skip = (argc > 2 && strcmp(argv[1], "-U") == 0) ? 3 : 1;
+	for (int i=skip; i <= argc; i++) {
+		new_argv[i-skip+3] = argv[i]; }
+
+	// Stop relaying and wait for recordings to be written, so no client changes state during handoff
+	tpool_pause();
+	record_drain();
+
+	// Fork helper that sends all clients to the new server, and again to each server started after a failure
+	// Only async-signal-safe calls are made in it, since the other server threads are not copied
+	switch (pid = fork()) {
+	case -1:
+		perror("Server: fork call failed");
+		free(new_argv);
+		close(exe_fd);
+		close(sv[0]);
+		close(sv[1]);
+		tpool_resume();
+		return;
+
+	case 0:
+		close(sv[0]);
+		for (int i=0; i < UPGRADE_TRIES; i++) {
+			if (send_clients(sv[1], server_sockfd, exe_fd) == -1 || recv(sv[1], &reply, 1, 0) != 1) {
+				_exit(EXIT_FAILURE); }
+			if (reply == UPGRADE_DONE) {
+				_exit(EXIT_SUCCESS); } }
+		_exit(EXIT_FAILURE);
+	}
+	close(sv[1]);
+	close(exe_fd);
+
+	// Keep new server's end open across exec, and start it unpinned so it can pin its own threads
+	sched_getaffinity(0, sizeof(accept_cpus), &accept_cpus);
+	sched_setaffinity(0, sizeof(bash_cpus), &bash_cpus);
+	if (fcntl(sv[0], F_SETFD, 0) != -1) {
+		execvp(new_argv[0], new_argv); }
+
+	// Exec failed, so closing the socket pair ends the helper, and the old server carries on
+	perror("Server: Error starting new server");
+	sched_setaffinity(0, sizeof(accept_cpus), &accept_cpus);
+	free(new_argv);
+	close(sv[0]);
+	waitpid(pid, NULL, 0);
+	tpool_resume();
+
+	return;
+}
+
+// Function to send the listening socket and every client's FDs and state to the new server
+// Runs in the forked upgrade helper; clients still in the TLS handshake are not sent
+// Returns 0 on success or -1 if the new server stopped receiving
+int send_clients(int upgrade_fd, int server_sockfd, int exe_fd)
+{
+	upgrade_msg_t msg;
+	int fd_list[3];
+
+	msg.pid = getpid();
+	for (int fd=0; fd < MAX_FDS; fd++) {
+		msg.state = fdstate[fd];
+		msg.pending_len[0] = 0;
+		msg.pending_len[1] = 0;
+		msg.secret_read = 0;
+		msg.exit_status = 0;
+
+		// New clients have not sent all of the secret yet, so only the socket is sent
+		if (fdstate[fd] == STATE_NEW) {
+			fd_list[0] = fd;
+			msg.secret_read = fdsecret[fd];
+			if (send_fds(upgrade_fd, &msg, fd_list, 1) == -1) {
+				return -1; } }
+
+		// Sessions are sent as their socket, pty master, and bash's pidfd, with their pending data
+		else if (fdstate[fd] == STATE_SOCKET) {
+			fd_list[0] = fd;
+			fd_list[1] = fds[fd];
+			fd_list[2] = pidfds[fd];
+			if (fdstate[pidfds[fd]] == STATE_DRAIN || fdstate[pidfds[fd]] == STATE_EXIT) {
+				msg.state = fdstate[pidfds[fd]];
+				msg.exit_status = fdexit[pidfds[fd]]; }
+			for (int i=0; i < 2; i++) {
+				if ((msg.pending_len[i] = fdpending_len[fd_list[i]]) > 0) {
+					memcpy(msg.pending[i], fdpending[fd_list[i]], msg.pending_len[i]); } }
+			if (send_fds(upgrade_fd, &msg, fd_list, 3) == -1) {
+				return -1; } }
+	}
+
+	// Send listening socket last, so the new server only accepts once it has every client
+	msg.state = STATE_FREE;
+	fd_list[0] = server_sockfd;
+	fd_list[1] = exe_fd;
+	return send_fds(upgrade_fd, &msg, fd_list, 2);
+}
+
+// Function to receive clients from the server being upgraded and add them to the epoll unit
+// Each FD is added fresh, so epoll reports any data or hang up left over from the old server
+// Once one client cannot be taken over, the rest are received and closed, so they can all be sent again
+// Returns the listening socket, or -1 if not every client was taken over
+int adopt_clients(int upgrade_fd, int *exe_fd)
+{
+	upgrade_msg_t msg;
+	int fd_list[3];
+	int num_fds;
+	int server_sockfd = -1;
+	int failed = 0;
+	char reply = UPGRADE_DONE;
+	struct epoll_event event;
+
+	while ((num_fds = recv_fds(upgrade_fd, &msg, fd_list, 3)) != -1) {
+		// Last message has the listening socket and the previous server's executable
+		if (msg.state == STATE_FREE && num_fds == 2) {
+			server_sockfd = fd_list[0];
+			*exe_fd = fd_list[1];
+			break; }
+
+		// Check that the message is complete and its FDs fit in the FD arrays
+		int valid = (msg.state == STATE_NEW && num_fds == 1) ||
+				((msg.state == STATE_SOCKET || msg.state == STATE_DRAIN || msg.state == STATE_EXIT) && num_fds == 3);
+		for (int i=0; i < 2; i++) {
+			if (msg.pending_len[i] < 0 || msg.pending_len[i] > BUFF_SIZE) {
+				valid = 0; } }
+		if (msg.secret_read < 0 || (size_t)msg.secret_read >= strlen(SECRET)) {
+			valid = 0; }
+		for (int i=0; i < num_fds; i++) {
+			if (fd_list[i] >= MAX_FDS) {
+				valid = 0; } }
+		if (!valid && !failed) {
+			fprintf(stderr, "Server: Could not take over client from previous server\n");
+			failed = 1; }
+		if (failed) {
+			for (int i=0; i < num_fds; i++) {
+				close(fd_list[i]); }
+			continue; }
+
+		// Restore session's FD arrays and watch its pidfd, as in handle_client
+		// A draining session's bash was already reaped, so its pidfd is not watched
+		int connect_fd = fd_list[0];
+		int pidfd = fd_list[2];
+		if (msg.state != STATE_NEW) {
+			int master_fd = fd_list[1];
+			fdstate[master_fd] = STATE_MASTER;
+			fdstate[pidfd] = (msg.state == STATE_SOCKET) ? STATE_PIDFD : msg.state;
+			fdexit[pidfd] = msg.exit_status;
+			fds[connect_fd] = master_fd;
+			fds[master_fd] = connect_fd;
+			fds[pidfd] = connect_fd;
+			pidfds[connect_fd] = pidfd;
+
+			event.events = EPOLLIN|EPOLLONESHOT;
+			event.data.fd = TASK(pidfd);
+			if (msg.state == STATE_SOCKET && epoll_ctl(epfd, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+				perror("Server: Error adding pidfd to epoll interest list");
+				failed = 1;
+				continue; }
+
+			// Recording continues in a new file
+			record_open(connect_fd);
+
+			// Keep data the old server could not relay yet
+			for (int i=0; i < 2 && !failed; i++) {
+				if (msg.pending_len[i] == 0) {
+					continue; }
+				if ((fdpending[fd_list[i]] = malloc(BUFF_SIZE)) == NULL) {
+					perror("Server: Failed to allocate memory for pending data");
+					failed = 1;
+					break; }
+				memcpy(fdpending[fd_list[i]], msg.pending[i], msg.pending_len[i]);
+				fdpending_len[fd_list[i]] = msg.pending_len[i]; } }
+
+		// Draining session only relays the rest of bash's output and exit status, starting once the
+		// socket can take it
+		if (msg.state == STATE_DRAIN || msg.state == STATE_EXIT) {
+			fdstate[connect_fd] = STATE_SOCKET;
+			if (!failed) {
+				set_deadline(pidfd, DRAIN_TIMEOUT_MS);
+				if (wait_writable(pidfd) == -1) {
+					failed = 1; } }
+			continue; }
+
+		// Watch client socket and pty master; one with data pending waits for its pair to take
+		// the data first, and is only added to the epoll interest list once it has been rearmed
+		fdstate[connect_fd] = msg.state;
+		fdsecret[connect_fd] = msg.secret_read;
+		for (int i=0; i < (msg.state == STATE_SOCKET ? 2 : 1) && !failed; i++) {
+			if (fdpending_len[fd_list[i]] > 0) {
+				if (wait_writable(fd_list[i]) == -1) {
+					failed = 1; }
+				continue; }
+			event.events = EPOLLIN|EPOLLET|EPOLLONESHOT;
+			event.data.fd = TASK(fd_list[i]);
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd_list[i], &event) == -1) {
+				perror("Server: Error adding client FD to epoll interest list");
+				failed = 1; } }
+	}
+
+	// Without the listening socket, the helper that had the clients is gone
+	if (server_sockfd == -1) {
+		fprintf(stderr, "Server: Upgrade from previous server failed\n");
+		exit(EXIT_FAILURE); }
+
+	// Leave the clients with the helper, so it can send them again
+	if (failed) {
+		close(server_sockfd);
+		return -1; }
+
+	// Tell helper every client was taken over, then reap it
+	send(upgrade_fd, &reply, 1, MSG_NOSIGNAL);
+	close(upgrade_fd);
+	close(*exe_fd);
+	waitpid(msg.pid, NULL, 0);
+
+	return server_sockfd;
+}
+
+// Function to start the previous server's executable again in this process, after the upgrade to
+// this one failed; the upgrade helper still has every client, and sends them to it again
+void roll_back_upgrade(int upgrade_fd, int exe_fd, char **argv)
+{
+	char reply = UPGRADE_RETRY;
+
+	fprintf(stderr, "Server: Could not take over every client, so starting previous server again\n");
+
+	// Start it unpinned with the same arguments, as upgrade_server does
+	sched_setaffinity(0, sizeof(bash_cpus), &bash_cpus);
+	if (send(upgrade_fd, &reply, 1, MSG_NOSIGNAL) == 1) {
+		fexecve(exe_fd, argv, environ); }
+
+	perror("Server: Error starting previous server");
+	exit(EXIT_FAILURE);
+}
+
+// Function to send message with num_fds FDs over a Unix socket
+// Returns 0 on success or -1 on failure
+int send_fds(int sockfd, upgrade_msg_t *msg, int *fd_list, int num_fds)
+{
+	struct msghdr msgh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = control.buf;
+	msgh.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+
+	// Attach FDs as ancillary data, so the receiver gets its own copies of them
+	cmsg = CMSG_FIRSTHDR(&msgh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fd_list, num_fds * sizeof(int));
+
+	return (sendmsg(sockfd, &msgh, MSG_NOSIGNAL) == sizeof(*msg)) ? 0 : -1;
+}
+
+// Function to receive message and up to max_fds FDs from a Unix socket
+// Returns number of FDs received, or -1 on failure or once the sender is gone
+int recv_fds(int sockfd, upgrade_msg_t *msg, int *fd_list, int max_fds)
+{
+	struct msghdr msgh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int num_fds = 0;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = control.buf;
+	msgh.msg_controllen = CMSG_SPACE(max_fds * sizeof(int));
+
+	if (recvmsg(sockfd, &msgh, MSG_CMSG_CLOEXEC) != sizeof(*msg)) {
+		return -1; }
+
+	// Copy out received FDs
+	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fd_list, CMSG_DATA(cmsg), num_fds * sizeof(int)); } }
+
+	return num_fds;
+}
+
+#ifdef KTLS
+// Function to create TLS context for the server's certificate and key
+// Sessions are limited to TLS 1.2 with AES-GCM or ChaCha20-Poly1305, which OpenSSL can hand to
+// the kernel in both directions; renegotiation is off since the kernel cannot handle it
+// Returns new context, or NULL on failure
+SSL_CTX *tls_server_ctx(const char *cert_file, const char *key_file)
+{
+	SSL_CTX *ctx;
+
+	if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL ||
+			!SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) ||
+			!SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION) ||
+			!SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20")) {
+		fprintf(stderr, "Server: Error creating TLS context\n");
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return NULL; }
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS|SSL_OP_NO_RENEGOTIATION);
+
+	// Load certificate chain and private key
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+			SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1) {
+		fprintf(stderr, "Server: Error loading TLS certificate or key\n");
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return NULL; }
+
+	return ctx;
+}
+
+// Function to run the server side of a client's TLS handshake without blocking
+// Once the handshake is done, the session keys are in the kernel and reads and writes on the
+// socket are encrypted by kTLS, so OpenSSL is freed and relay_data moves data as before
+void tls_accept(int connect_fd)
+{
+	const char * const rembash = "<rembash>\n";
+	SSL *ssl = tls_ssl[connect_fd];
+	int ret;
+
+	// Create TLS connection for socket on first call
+	if (ssl == NULL) {
+		if ((ssl = SSL_new(tls_ctx)) == NULL || SSL_set_fd(ssl, connect_fd) != 1) {
+			fprintf(stderr, "Server: Error creating TLS connection\n");
+			ERR_print_errors_fp(stderr);
+			SSL_free(ssl);
+			fdstate[connect_fd] = STATE_FREE;
+			close(connect_fd);
+			return; }
+		tls_ssl[connect_fd] = ssl; }
+
+	// Continue handshake; if it is waiting on the client, try again on the next event
+	if ((ret = SSL_accept(ssl)) != 1) {
+		switch (SSL_get_error(ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			rearm_fd(connect_fd);
+			return;
+		case SSL_ERROR_WANT_WRITE:
+			if (tpool_add_task(TASK(connect_fd), TPOOL_PRIO_HIGH) != 1) {
+				tls_close(connect_fd); }
+			return;
+		default:
+			fprintf(stderr, "Server: TLS handshake failed for client (FD %d)\n", connect_fd);
+			ERR_print_errors_fp(stderr);
+			tls_close(connect_fd);
+			return; } }
+
+	// Check that the kernel took over encryption in both directions
+	if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+		fprintf(stderr, "Server: Kernel TLS is not available for client (FD %d); is the tls module loaded?\n", connect_fd);
+		tls_close(connect_fd);
+		return; }
+
+	// OpenSSL is no longer needed; freeing it leaves the socket open
+	SSL_free(ssl);
+	tls_ssl[connect_fd] = NULL;
+	fdstate[connect_fd] = STATE_NEW;
+	fdsecret[connect_fd] = 0;
+
+	// Write initial rembash message to client over the encrypted socket
+	if (write(connect_fd, rembash, strlen(rembash)) == -1) {
+		perror("Server: Error writing rembash to socket");
+		fdstate[connect_fd] = STATE_FREE;
+		close(connect_fd);
+		return; }
+
+	rearm_fd(connect_fd);
+}
+
+// Function to free a socket's TLS connection and close the socket
+void tls_close(int connect_fd)
+{
+	SSL_free(tls_ssl[connect_fd]);
+	tls_ssl[connect_fd] = NULL;
+	fdstate[connect_fd] = STATE_FREE;
+	close(connect_fd);
+}
+#endif
+
 // Function to print process/thread information
 void print_id_info(char *message)
 {
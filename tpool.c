@@ -1,28 +1,103 @@
 // RemoteBASH
 // Thread Pool Source
 
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include "tpool.h"
 
 #define INIT_TASKS_PER_THREAD 4
+#define MAX_HIGH_PRIO_STREAK 8
 
-// Thread pool struct with variables for queue, mutexes, and condition variables
-typedef struct tpool {
+// Queue struct for one priority lane of the thread pool
+typedef struct tpool_queue {
     int *queue;
     int queue_first;
     int queue_last;
     int queue_max;
+    int queue_size;
+} tpool_queue_t;
+
+// Thread pool struct with variables for queues, mutexes, and condition variables
+// high_prio_streak counts high priority tasks taken in a row while low priority tasks waited
+// While paused, workers finish their current task and take no new ones; busy_threads counts
+// workers still running a task
+struct tpool {
+    tpool_queue_t lanes[TPOOL_NUM_PRIOS];
+    int high_prio_streak;
     int task_count;
     int num_worker_threads;
+    int paused;
+    int busy_threads;
     pthread_mutex_t queue_mtx;
     pthread_mutex_t queue_empty_mtx;
     pthread_cond_t queue_empty_cv;
-} tpool_t;
+    pthread_cond_t idle_cv;
+};
 
 // Declare tpool struct for the thread pool
-tpool_t tpool;
+static tpool_t tpool;
+
+// Function to initialize one priority lane's queue
+// Returns 1 on success or 0 on failure
+static int queue_init(tpool_queue_t *lane, int queue_max)
+{
+    lane->queue_first = -1;
+    lane->queue_last = -1;
+    lane->queue_size = 0;
+    lane->queue_max = queue_max;
+    lane->queue = malloc(lane->queue_max * sizeof(int));
+    
+    return lane->queue != NULL;
+}
+
+// Function to enqueue task in a priority lane, expanding the lane if it is full
+// Must be called with queue_mtx locked; returns 1 on success or 0 on failure
+static int queue_push(tpool_queue_t *lane, int task)
+{
+    // If queue is full, expand it
+    if (lane->queue_size == lane->queue_max) {
+        int *new_queue = realloc(lane->queue, lane->queue_max * 2 * sizeof(int));
+        if (new_queue == NULL) {
+            return 0; }
+        lane->queue = new_queue;
+        lane->queue_max *= 2;
+        if (lane->queue_first > lane->queue_last) {
+            int i = lane->queue_size;
+            for (int j=0; j<=lane->queue_last; j++) {
+                lane->queue[i++] = lane->queue[j];
+            }
+            lane->queue_last += lane->queue_size; }
+    }
+    
+    // Enqueue task and update queue variables
+    lane->queue_last = (lane->queue_last+1)%lane->queue_max;
+    lane->queue[lane->queue_last] = task;
+    lane->queue_size++;
+    if (lane->queue_first == -1) {
+        lane->queue_first = lane->queue_last; }
+    
+    return 1;
+}
+
+// Function to dequeue task from a priority lane
+// Must be called with queue_mtx locked and the lane not empty
+static int queue_pop(tpool_queue_t *lane)
+{
+    // Dequeue data and update queue variables
+    int task = lane->queue[lane->queue_first];
+    lane->queue_size--;
+    if (lane->queue_first == lane->queue_last) {
+        lane->queue_first = -1;
+        lane->queue_last = -1; }
+    else {
+        lane->queue_first = (lane->queue_first+1)%lane->queue_max; }
+    
+    return task;
+}
 
 // Worker function to be passed to thread pool threads
 static void *thread_worker(void *process_task_func)
@@ -34,30 +109,42 @@ static void *thread_worker(void *process_task_func)
         // Lock queue_empty mutex or wait for it to be unlocked
         pthread_mutex_lock(&tpool.queue_empty_mtx);
         
-        while (tpool.task_count == 0) {
+        while (tpool.task_count == 0 || tpool.paused) {
             pthread_cond_wait(&tpool.queue_empty_cv, &tpool.queue_empty_mtx); }
         
         tpool.task_count--;
+        tpool.busy_threads++;
         
         // Unlock queue_empty mutex
         pthread_mutex_unlock(&tpool.queue_empty_mtx);
         
-        // Unlock main queue mutex
+        // Lock main queue mutex or wait for it to be unlocked
         pthread_mutex_lock(&tpool.queue_mtx);
         
-        // Dequeue data and update queue variables
-        int task = tpool.queue[tpool.queue_first];
-        if (tpool.queue_first == tpool.queue_last) {
-            tpool.queue_first = -1;
-            tpool.queue_last = -1; }
+        // Take high priority task first, unless low priority tasks have waited for too many of them
+        tpool_queue_t *high = &tpool.lanes[TPOOL_PRIO_HIGH];
+        tpool_queue_t *low = &tpool.lanes[TPOOL_PRIO_LOW];
+        int task;
+        if (high->queue_size > 0 &&
+                (low->queue_size == 0 || tpool.high_prio_streak < MAX_HIGH_PRIO_STREAK)) {
+            task = queue_pop(high);
+            if (low->queue_size > 0) {
+                tpool.high_prio_streak++; } }
         else {
-            tpool.queue_first = (tpool.queue_first+1)%tpool.queue_max; }
+            task = queue_pop(low);
+            tpool.high_prio_streak = 0; }
         
-        // Lock main queue mutex or wait for it to be unlocked
+        // Unlock main queue mutex
         pthread_mutex_unlock(&tpool.queue_mtx);
         
         // Process task using function passed in tpool_init
         process_task(task);
+        
+        // Let tpool_pause know once the last busy worker is done
+        pthread_mutex_lock(&tpool.queue_empty_mtx);
+        if (--tpool.busy_threads == 0 && tpool.paused) {
+            pthread_cond_signal(&tpool.idle_cv); }
+        pthread_mutex_unlock(&tpool.queue_empty_mtx);
     }
     
     // Should not get here
@@ -65,22 +152,27 @@ static void *thread_worker(void *process_task_func)
 }
 
 // Function to initialize tpool struct and create worker threads
-int tpool_init(void (*process_task)(int))
+// Uses num_threads workers, or one per available core if num_threads is less than 1
+// If num_cpus is not 0, workers are pinned to the CPUs in cpus, assigned round robin
+int tpool_init(void (*process_task)(int), int num_threads, const int *cpus, int num_cpus)
 {
-    // Set num_worker_threads equal to the number of cores available
-    tpool.num_worker_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    // Set num_worker_threads equal to num_threads or the number of cores available
+    if (num_threads > 0) {
+        tpool.num_worker_threads = num_threads; }
+    else {
+        tpool.num_worker_threads = sysconf(_SC_NPROCESSORS_ONLN); }
     
-    // Initialize tpool queue
-    tpool.queue_first = -1;
-    tpool.queue_last = -1;
+    // Initialize tpool queues
     tpool.task_count = 0;
-    tpool.queue_max = tpool.num_worker_threads * INIT_TASKS_PER_THREAD;
-    tpool.queue = malloc(tpool.queue_max * sizeof(int));
-    
-    // Check for queue allocation failure
-    if (tpool.queue == NULL) {
-        perror("Tpool: Error allocating memory for queue");
-        return 0; }
+    tpool.high_prio_streak = 0;
+    tpool.paused = 0;
+    tpool.busy_threads = 0;
+    for (int i=0; i < TPOOL_NUM_PRIOS; i++) {
+        // Check for queue allocation failure
+        if (!queue_init(&tpool.lanes[i], tpool.num_worker_threads * INIT_TASKS_PER_THREAD)) {
+            perror("Tpool: Error allocating memory for queue");
+            return 0; }
+    }
     
     // Initialize tpool mutexes
     if (pthread_mutex_init(&tpool.queue_mtx, NULL) ||
@@ -89,46 +181,54 @@ int tpool_init(void (*process_task)(int))
         return 0; }
     
     // Initialize tpool condition variables
-    if (pthread_cond_init(&tpool.queue_empty_cv, NULL)) {
+    if (pthread_cond_init(&tpool.queue_empty_cv, NULL) ||
+            pthread_cond_init(&tpool.idle_cv, NULL)) {
         perror("Tpool: Error initializing tpool condition variables");
         return 0; }
     
-    // Loop to create a number of threads equal to the number of available cores
+    // Loop to create num_worker_threads threads
     for (int i=0; i < tpool.num_worker_threads; i++) {
         pthread_t worker_tid;
+        pthread_attr_t attr;
+        cpu_set_t cpuset;
+        
+        if (pthread_attr_init(&attr)) {
+            perror("Tpool: Error initializing worker thread attributes");
+            return 0; }
         
-        if (pthread_create(&worker_tid, NULL, thread_worker, process_task)) {
+        // Pin worker before it starts, so its stack is first touched on its own CPU's NUMA node
+        if (num_cpus > 0) {
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpus[i % num_cpus], &cpuset);
+            if (pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset)) {
+                perror("Tpool: Error setting worker thread CPU affinity");
+                return 0; } }
+        
+        if (pthread_create(&worker_tid, &attr, thread_worker, process_task)) {
             perror("Tpool: Error creating worker thread\n");
             return 0; }
+        
+        pthread_attr_destroy(&attr);
     }
     
     // Thread pool initialized successfully
     return 1;
 }
 
-// Function to add task to thread pool's task queue
-int tpool_add_task(int new_task)
+// Function to add task to the task queue of the given priority lane
+int tpool_add_task(int new_task, int priority)
 {
+    // Check for valid priority lane
+    if (priority < 0 || priority >= TPOOL_NUM_PRIOS) {
+        return 0; }
+    
     // Lock main queue mutex or wait for it to be unlocked
     pthread_mutex_lock(&tpool.queue_mtx);
     
-    // If queue is full, expand it
-    if (tpool.task_count == tpool.queue_max) {
-        tpool.queue_max *= 2;
-        tpool.queue = realloc(tpool.queue, tpool.queue_max * sizeof(int));
-        if (tpool.queue_first > tpool.queue_last) {
-            int i = tpool.task_count;
-            for (int j=0; j<=tpool.queue_last; j++) {
-                tpool.queue[i++] = tpool.queue[j];
-            }
-            tpool.queue_last += tpool.task_count; }
-    }
-    
-    // Enqueue task and update queue variables
-    tpool.queue_last = (tpool.queue_last+1)%tpool.queue_max;
-    tpool.queue[tpool.queue_last] = new_task;
-    if (tpool.queue_first == -1) {
-        tpool.queue_first = tpool.queue_last; }
+    // Enqueue task, expanding lane's queue if needed
+    if (!queue_push(&tpool.lanes[priority], new_task)) {
+        pthread_mutex_unlock(&tpool.queue_mtx);
+        return 0; }
     
     // Unlock main queue mutex
     pthread_mutex_unlock(&tpool.queue_mtx);
@@ -149,5 +249,29 @@ int tpool_add_task(int new_task)
     return 1;
 }
 
+// Function to stop workers from taking tasks and wait until none is running one
+// Tasks can still be added while paused; they wait in the queue until tpool_resume
+void tpool_pause(void)
+{
+    pthread_mutex_lock(&tpool.queue_empty_mtx);
+    
+    tpool.paused = 1;
+    while (tpool.busy_threads > 0) {
+        pthread_cond_wait(&tpool.idle_cv, &tpool.queue_empty_mtx); }
+    
+    pthread_mutex_unlock(&tpool.queue_empty_mtx);
+}
+
+// Function to let workers take tasks again after tpool_pause
+void tpool_resume(void)
+{
+    pthread_mutex_lock(&tpool.queue_empty_mtx);
+    
+    tpool.paused = 0;
+    pthread_cond_broadcast(&tpool.queue_empty_cv);
+    
+    pthread_mutex_unlock(&tpool.queue_empty_mtx);
+}
+
 
 // EOF
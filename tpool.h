@@ -1,13 +1,20 @@
 // RemoteBASH
 // Thread Pool Header
 
-typedef struct tpool {} tpool_t;
+typedef struct tpool tpool_t;
 
-tpool_t tpool;
+// Priority lanes for tasks; workers check the high priority lane first
+#define TPOOL_PRIO_HIGH 0
+#define TPOOL_PRIO_LOW 1
+#define TPOOL_NUM_PRIOS 2
 
-int tpool_init(void (*process_task)(int));
+int tpool_init(void (*process_task)(int), int num_threads, const int *cpus, int num_cpus);
 
-int tpool_add_task(int new_task);
+int tpool_add_task(int new_task, int priority);
+
+void tpool_pause(void);
+
+void tpool_resume(void);
 
 
 // EOF
@@ -0,0 +1,277 @@
+// RemoteBASH
+// Thread Pool Benchmark
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "tpool.h"
+
+// Define preprocessor constants for the default run and how long to wait for missing tasks
+#define DEFAULT_TASKS 1000000
+#define DEFAULT_PRODUCERS 4
+#define MAX_CONFIGS 64
+#define LOW_PRIO_EVERY 4
+#define STALL_NSEC 5000000000L
+#define POLL_NSEC 1000000
+
+// Producer struct for the range of task IDs one producer thread adds
+typedef struct producer {
+	int first;
+	int last;
+} producer_t;
+
+// Function prototypes
+int run_config(int num_threads);
+void *producer(void *arg);
+void bench_task(int task);
+long now_ns();
+int compare_long(const void *a, const void *b);
+long percentile(long *sorted, int count, double pct);
+int parse_thread_list(char *list, int *thread_counts);
+
+//Globals for run settings, shared by producers and workers
+int num_tasks = DEFAULT_TASKS;
+int num_producers = DEFAULT_PRODUCERS;
+long work_ns = 0;
+
+//Globals for each task's enqueue time, enqueue-to-execute latency, and times it was run
+//executed counts task runs of any task, so main can tell when the run is finished
+long *enqueued;
+long *latency;
+int *runs;
+int executed;
+
+
+int main(int argc, char **argv)
+{
+	const char * const usage = "Usage: tpool-bench [-n TASKS] [-p PRODUCERS] [-w WORK_NS] [-t THREAD_LIST]\n";
+	int thread_counts[MAX_CONFIGS];
+	int num_configs = 0;
+	int failed = 0;
+	int opt;
+	pid_t pid;
+
+	// Get run settings from command line options
+	while ((opt = getopt(argc, argv, "n:p:w:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_tasks = atoi(optarg);
+			break;
+		case 'p':
+			num_producers = atoi(optarg);
+			break;
+		case 'w':
+			work_ns = atol(optarg);
+			break;
+		case 't':
+			if ((num_configs = parse_thread_list(optarg, thread_counts)) < 1) {
+				fprintf(stderr, "Tpool-bench: Invalid thread list: %s\n", optarg);
+				exit(EXIT_FAILURE); }
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE); } }
+
+	if (optind != argc || num_tasks < 1 || num_producers < 1 || work_ns < 0) {
+		fprintf(stderr, "%s", usage);
+		exit(EXIT_FAILURE); }
+
+	// Default to powers of two up to twice the number of cores
+	if (num_configs == 0) {
+		long max_threads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+		for (int n=1; n <= max_threads && num_configs < MAX_CONFIGS; n *= 2) {
+			thread_counts[num_configs++] = n; } }
+
+	printf("Tasks: %d, producers: %d, work per task: %ld ns, low priority: 1 in %d\n",
+			num_tasks, num_producers, work_ns, LOW_PRIO_EVERY);
+	printf("%7s %11s %9s %9s %9s %9s %9s %9s %9s %7s %7s\n", "threads", "tasks/s", "p50 us", "p90 us",
+			"p99 us", "p99.9 us", "max us", "high p99", "low p99", "lost", "dup");
+	fflush(stdout);
+
+	// Run each thread count in its own process, since a thread pool cannot be shut down and started again
+	for (int i=0; i < num_configs; i++) {
+		switch (pid = fork()) {
+		case -1:
+			perror("Tpool-bench: fork call failed");
+			exit(EXIT_FAILURE);
+
+		case 0:
+			exit(run_config(thread_counts[i]));
+		}
+
+		int status;
+		if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			failed = 1; }
+	}
+
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+// Function to run every task through a thread pool with num_threads workers and print its results
+// Returns EXIT_SUCCESS if every task ran exactly once, or EXIT_FAILURE otherwise
+int run_config(int num_threads)
+{
+	pthread_t tids[num_producers];
+	producer_t producers[num_producers];
+	long start, end, last_progress;
+	int done, prev_done = 0;
+	struct timespec poll_wait = {0, POLL_NSEC};
+
+	// Allocate per task arrays
+	if ((enqueued = calloc(num_tasks, sizeof(long))) == NULL ||
+			(latency = calloc(num_tasks, sizeof(long))) == NULL ||
+			(runs = calloc(num_tasks, sizeof(int))) == NULL) {
+		perror("Tpool-bench: Error allocating memory for tasks");
+		return EXIT_FAILURE; }
+
+	// Start thread pool; its queues start small, so the run also covers growing them under load
+	if (tpool_init(bench_task, num_threads, NULL, 0) != 1) {
+		fprintf(stderr, "Tpool-bench: Error initializing thread pool\n");
+		return EXIT_FAILURE; }
+
+	// Start producers, each adding its own share of the task IDs
+	start = now_ns();
+	for (int i=0; i < num_producers; i++) {
+		producers[i].first = (long)num_tasks * i / num_producers;
+		producers[i].last = (long)num_tasks * (i+1) / num_producers;
+		if (pthread_create(&tids[i], NULL, producer, &producers[i])) {
+			perror("Tpool-bench: Error creating producer thread");
+			return EXIT_FAILURE; } }
+	for (int i=0; i < num_producers; i++) {
+		pthread_join(tids[i], NULL); }
+
+	// Wait until as many tasks ran as were added, or until no task has run for a while
+	// If tasks are missing, throughput is measured up to the last time a task ran
+	last_progress = now_ns();
+	while ((done = __atomic_load_n(&executed, __ATOMIC_ACQUIRE)) < num_tasks) {
+		if (done != prev_done) {
+			prev_done = done;
+			last_progress = now_ns(); }
+		else if (now_ns() - last_progress > STALL_NSEC) {
+			break; }
+		nanosleep(&poll_wait, NULL); }
+	end = (done < num_tasks) ? last_progress : now_ns();
+
+	// Give any task that was queued twice time to run again, then check each task ran exactly once
+	nanosleep(&poll_wait, NULL);
+	int lost = 0, dup = 0;
+	for (int i=0; i < num_tasks; i++) {
+		int count = __atomic_load_n(&runs[i], __ATOMIC_ACQUIRE);
+		if (count == 0) {
+			lost++; }
+		else if (count > 1) {
+			dup++; } }
+
+	// Split latencies by priority lane and sort them for percentiles
+	int num_high = 0, num_low = 0;
+	long *high = malloc(num_tasks * sizeof(long));
+	long *low = malloc(num_tasks * sizeof(long));
+	if (high == NULL || low == NULL) {
+		perror("Tpool-bench: Error allocating memory for results");
+		return EXIT_FAILURE; }
+	for (int i=0; i < num_tasks; i++) {
+		if (runs[i] == 0) {
+			continue; }
+		if (i % LOW_PRIO_EVERY == 0) {
+			low[num_low++] = latency[i]; }
+		else {
+			high[num_high++] = latency[i]; } }
+	qsort(high, num_high, sizeof(long), compare_long);
+	qsort(low, num_low, sizeof(long), compare_long);
+
+	// Sorted copy of all latencies
+	int num_all = 0;
+	for (int i=0; i < num_tasks; i++) {
+		if (runs[i] != 0) {
+			latency[num_all++] = latency[i]; } }
+	qsort(latency, num_all, sizeof(long), compare_long);
+
+	printf("%7d %11.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %7d %7d\n", num_threads,
+			done / ((end - start) / 1e9),
+			percentile(latency, num_all, 50) / 1e3, percentile(latency, num_all, 90) / 1e3,
+			percentile(latency, num_all, 99) / 1e3, percentile(latency, num_all, 99.9) / 1e3,
+			percentile(latency, num_all, 100) / 1e3,
+			percentile(high, num_high, 99) / 1e3, percentile(low, num_low, 99) / 1e3, lost, dup);
+	fflush(stdout);
+
+	return (lost || dup) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Producer function for producer threads
+// Adds each task in its range, marking every LOW_PRIO_EVERYth task low priority like bulk relays
+void *producer(void *arg)
+{
+	producer_t *range = arg;
+
+	for (int task = range->first; task < range->last; task++) {
+		int priority = (task % LOW_PRIO_EVERY == 0) ? TPOOL_PRIO_LOW : TPOOL_PRIO_HIGH;
+		enqueued[task] = now_ns();
+		if (tpool_add_task(task, priority) != 1) {
+			fprintf(stderr, "Tpool-bench: Failed to add task %d\n", task); } }
+
+	return NULL;
+}
+
+// Task function for thread pool workers
+// Records task's latency and run count, then spins for work_ns to stand in for relaying data
+void bench_task(int task)
+{
+	long start = now_ns();
+
+	latency[task] = start - enqueued[task];
+	while (work_ns > 0 && now_ns() - start < work_ns);
+
+	__atomic_add_fetch(&runs[task], 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&executed, 1, __ATOMIC_RELEASE);
+}
+
+// Function to get monotonic clock time in nanoseconds
+long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Comparison function for sorting latencies with qsort
+int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+// Function to get the pct percentile of count sorted values, or 0 if there are none
+long percentile(long *sorted, int count, double pct)
+{
+	if (count == 0) {
+		return 0; }
+
+	int i = (int)(count * pct / 100);
+	return sorted[i < count ? i : count-1];
+}
+
+// Function to parse a comma separated list of thread counts such as "1,2,4,8"
+// Returns number of thread counts parsed, or -1 if list is invalid
+int parse_thread_list(char *list, int *thread_counts)
+{
+	int num_configs = 0;
+	char *count, *saveptr;
+
+	for (count = strtok_r(list, ",", &saveptr); count != NULL; count = strtok_r(NULL, ",", &saveptr)) {
+		if (num_configs == MAX_CONFIGS || (thread_counts[num_configs++] = atoi(count)) < 1) {
+			return -1; }
+	}
+
+	return num_configs;
+}
+
+
+// EOF